@@ -0,0 +1,238 @@
+#include "asset.h"
+
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+#include "mutex.h"
+#include "lz4/xxhash.h"
+
+#include <stdint.h>
+#include <string.h>
+
+enum
+{
+	k_asset_cache_bucket_count = 256,
+};
+
+typedef struct asset_t
+{
+	asset_cache_t* cache;
+	struct asset_t* next_in_bucket;
+	// Links in the cache's LRU list, only while unreferenced.
+	struct asset_t* lru_prev;
+	struct asset_t* lru_next;
+	uint64_t hash;
+	char* path;
+	fs_work_t* work;
+	int ref_count;
+	size_t size;
+} asset_t;
+
+typedef struct asset_cache_t
+{
+	heap_t* heap;
+	fs_t* fs;
+	mutex_t* mutex;
+	asset_t* buckets[k_asset_cache_bucket_count];
+	// Unreferenced assets, most recently released first.
+	asset_t* lru_head;
+	asset_t* lru_tail;
+	size_t budget;
+	size_t unused_size;
+	int asset_count;
+} asset_cache_t;
+
+static void lru_insert(asset_cache_t* cache, asset_t* asset);
+static void lru_remove(asset_cache_t* cache, asset_t* asset);
+static void evict(asset_cache_t* cache, asset_t* asset);
+static asset_t* acquire(asset_cache_t* cache, const char* path, bool mapped);
+
+asset_cache_t* asset_cache_create(heap_t* heap, fs_t* fs, size_t budget)
+{
+	asset_cache_t* cache = heap_alloc(heap, sizeof(asset_cache_t), 8);
+	memset(cache, 0, sizeof(*cache));
+	cache->heap = heap;
+	cache->fs = fs;
+	cache->mutex = mutex_create();
+	cache->budget = budget;
+	return cache;
+}
+
+void asset_cache_destroy(asset_cache_t* cache)
+{
+	while (cache->lru_tail)
+	{
+		evict(cache, cache->lru_tail);
+	}
+	if (cache->asset_count)
+	{
+		debug_print(k_print_warning, "Asset cache destroyed with %d assets still referenced\n", cache->asset_count);
+	}
+	mutex_destroy(cache->mutex);
+	heap_free(cache->heap, cache);
+}
+
+asset_t* asset_acquire(asset_cache_t* cache, const char* path)
+{
+	return acquire(cache, path, false);
+}
+
+asset_t* asset_acquire_mapped(asset_cache_t* cache, const char* path)
+{
+	return acquire(cache, path, true);
+}
+
+void asset_release(asset_t* asset)
+{
+	// Wait outside the lock so other loads can proceed.
+	fs_work_wait(asset->work);
+
+	asset_cache_t* cache = asset->cache;
+	mutex_lock(cache->mutex);
+
+	if (--asset->ref_count == 0)
+	{
+		// Failed loads are not worth keeping; the next acquire retries.
+		if (fs_work_get_result(asset->work) != 0)
+		{
+			evict(cache, asset);
+		}
+		else
+		{
+			asset->size = fs_work_get_size(asset->work);
+			lru_insert(cache, asset);
+			cache->unused_size += asset->size;
+			while (cache->unused_size > cache->budget && cache->lru_tail)
+			{
+				evict(cache, cache->lru_tail);
+			}
+		}
+	}
+
+	mutex_unlock(cache->mutex);
+}
+
+bool asset_is_ready(asset_t* asset)
+{
+	return fs_work_is_done(asset->work);
+}
+
+void asset_wait(asset_t* asset)
+{
+	fs_work_wait(asset->work);
+}
+
+int asset_get_result(asset_t* asset)
+{
+	return fs_work_get_result(asset->work);
+}
+
+const void* asset_get_data(asset_t* asset)
+{
+	return fs_work_get_buffer(asset->work);
+}
+
+size_t asset_get_size(asset_t* asset)
+{
+	return fs_work_get_size(asset->work);
+}
+
+static void lru_insert(asset_cache_t* cache, asset_t* asset)
+{
+	asset->lru_prev = NULL;
+	asset->lru_next = cache->lru_head;
+	if (cache->lru_head)
+	{
+		cache->lru_head->lru_prev = asset;
+	}
+	else
+	{
+		cache->lru_tail = asset;
+	}
+	cache->lru_head = asset;
+}
+
+static void lru_remove(asset_cache_t* cache, asset_t* asset)
+{
+	if (asset->lru_prev)
+	{
+		asset->lru_prev->lru_next = asset->lru_next;
+	}
+	else
+	{
+		cache->lru_head = asset->lru_next;
+	}
+	if (asset->lru_next)
+	{
+		asset->lru_next->lru_prev = asset->lru_prev;
+	}
+	else
+	{
+		cache->lru_tail = asset->lru_prev;
+	}
+	asset->lru_prev = NULL;
+	asset->lru_next = NULL;
+}
+
+// Free an unreferenced asset. Assets in the LRU list are removed from it.
+static void evict(asset_cache_t* cache, asset_t* asset)
+{
+	asset_t** link = &cache->buckets[asset->hash % k_asset_cache_bucket_count];
+	while (*link != asset)
+	{
+		link = &(*link)->next_in_bucket;
+	}
+	*link = asset->next_in_bucket;
+
+	if (asset->lru_prev || asset->lru_next || cache->lru_head == asset)
+	{
+		lru_remove(cache, asset);
+		cache->unused_size -= asset->size;
+	}
+	--cache->asset_count;
+
+	fs_work_destroy(asset->work);
+	heap_free(cache->heap, asset->path);
+	heap_free(cache->heap, asset);
+}
+
+static asset_t* acquire(asset_cache_t* cache, const char* path, bool mapped)
+{
+	size_t path_length = strlen(path);
+	uint64_t hash = XXH64(path, path_length, 0);
+
+	mutex_lock(cache->mutex);
+
+	asset_t** bucket = &cache->buckets[hash % k_asset_cache_bucket_count];
+	asset_t* asset = *bucket;
+	while (asset && (asset->hash != hash || strcmp(asset->path, path) != 0))
+	{
+		asset = asset->next_in_bucket;
+	}
+
+	if (asset)
+	{
+		if (asset->ref_count++ == 0)
+		{
+			lru_remove(cache, asset);
+			cache->unused_size -= asset->size;
+		}
+	}
+	else
+	{
+		asset = heap_alloc(cache->heap, sizeof(asset_t), 8);
+		memset(asset, 0, sizeof(*asset));
+		asset->cache = cache;
+		asset->hash = hash;
+		asset->path = heap_alloc(cache->heap, path_length + 1, 8);
+		memcpy(asset->path, path, path_length + 1);
+		asset->work = mapped ? fs_map(cache->fs, path) : fs_read(cache->fs, path, cache->heap, false, false);
+		asset->ref_count = 1;
+		asset->next_in_bucket = *bucket;
+		*bucket = asset;
+		++cache->asset_count;
+	}
+
+	mutex_unlock(cache->mutex);
+	return asset;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Shared, reference counted asset loads.
+//
+// Assets are keyed by path. Acquiring a path that is already loaded or
+// loading shares the same file work and buffer. Assets nobody references
+// stay cached while their total size is within the cache's memory budget;
+// past it, the least recently released are freed first.
+
+// Handle to an asset cache.
+typedef struct asset_cache_t asset_cache_t;
+
+// Handle to an asset in a cache.
+typedef struct asset_t asset_t;
+
+typedef struct fs_t fs_t;
+typedef struct heap_t heap_t;
+
+// Create an asset cache that loads through the provided file system.
+// Unreferenced assets are kept while their total size is within budget bytes.
+asset_cache_t* asset_cache_create(heap_t* heap, fs_t* fs, size_t budget);
+
+// Destroy an asset cache.
+// All assets must have been released.
+void asset_cache_destroy(asset_cache_t* cache);
+
+// Get an asset, queueing a load if it is not already cached.
+// Returns immediately with a new reference; the caller must call asset_release.
+asset_t* asset_acquire(asset_cache_t* cache, const char* path);
+
+// Get an asset like asset_acquire, but load it with fs_map instead of a read.
+// Suits large read-only assets: the data stays in the OS page cache instead of a heap copy.
+// A path already cached is shared as loaded, whichever way it was acquired.
+asset_t* asset_acquire_mapped(asset_cache_t* cache, const char* path);
+
+// Drop a reference to an asset.
+// Blocks for the asset to finish loading. The asset's data must not be used afterwards.
+void asset_release(asset_t* asset);
+
+// If true, the asset has finished loading.
+bool asset_is_ready(asset_t* asset);
+
+// Block for the asset to finish loading.
+void asset_wait(asset_t* asset);
+
+// Get the error code for the asset's load, blocking until it is done.
+// A value of zero generally indicates success.
+int asset_get_result(asset_t* asset);
+
+// Get the asset's contents, blocking until it is loaded.
+// The data is shared and must not be modified.
+const void* asset_get_data(asset_t* asset);
+
+// Get the size of the asset's contents, blocking until it is loaded.
+size_t asset_get_size(asset_t* asset);
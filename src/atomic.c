@@ -27,3 +27,247 @@ void atomic_store(int* address, int value)
 {
 	*(volatile int*)address = value;
 }
+
+int32_t atomic_load32(const volatile int32_t* address, atomic_order_t order)
+{
+	if (order == k_atomic_relaxed)
+	{
+		return ReadNoFence((const volatile LONG*)address);
+	}
+	return ReadAcquire((const volatile LONG*)address);
+}
+
+int64_t atomic_load64(const volatile int64_t* address, atomic_order_t order)
+{
+	if (order == k_atomic_relaxed)
+	{
+		return ReadNoFence64((const volatile LONG64*)address);
+	}
+	return ReadAcquire64((const volatile LONG64*)address);
+}
+
+void* atomic_load_ptr(void* const volatile* address, atomic_order_t order)
+{
+	if (order == k_atomic_relaxed)
+	{
+		return ReadPointerNoFence((PVOID const volatile*)address);
+	}
+	return ReadPointerAcquire((PVOID const volatile*)address);
+}
+
+void atomic_store32(volatile int32_t* address, int32_t value, atomic_order_t order)
+{
+	switch (order)
+	{
+	case k_atomic_relaxed:
+		WriteNoFence((volatile LONG*)address, value);
+		break;
+	case k_atomic_seq_cst:
+		InterlockedExchange((volatile LONG*)address, value);
+		break;
+	default:
+		WriteRelease((volatile LONG*)address, value);
+		break;
+	}
+}
+
+void atomic_store64(volatile int64_t* address, int64_t value, atomic_order_t order)
+{
+	switch (order)
+	{
+	case k_atomic_relaxed:
+		WriteNoFence64((volatile LONG64*)address, value);
+		break;
+	case k_atomic_seq_cst:
+		InterlockedExchange64((volatile LONG64*)address, value);
+		break;
+	default:
+		WriteRelease64((volatile LONG64*)address, value);
+		break;
+	}
+}
+
+void atomic_store_ptr(void* volatile* address, void* value, atomic_order_t order)
+{
+	switch (order)
+	{
+	case k_atomic_relaxed:
+		WritePointerNoFence((PVOID volatile*)address, value);
+		break;
+	case k_atomic_seq_cst:
+		InterlockedExchangePointer((PVOID volatile*)address, value);
+		break;
+	default:
+		WritePointerRelease((PVOID volatile*)address, value);
+		break;
+	}
+}
+
+int32_t atomic_fetch_add32(volatile int32_t* address, int32_t value, atomic_order_t order)
+{
+	switch (order)
+	{
+	case k_atomic_relaxed: return InterlockedExchangeAddNoFence((volatile LONG*)address, value);
+	case k_atomic_acquire: return InterlockedExchangeAddAcquire((volatile LONG*)address, value);
+	case k_atomic_release: return InterlockedExchangeAddRelease((volatile LONG*)address, value);
+	default: return InterlockedExchangeAdd((volatile LONG*)address, value);
+	}
+}
+
+int64_t atomic_fetch_add64(volatile int64_t* address, int64_t value, atomic_order_t order)
+{
+	switch (order)
+	{
+	case k_atomic_relaxed: return InterlockedExchangeAddNoFence64((volatile LONG64*)address, value);
+	case k_atomic_acquire: return InterlockedExchangeAddAcquire64((volatile LONG64*)address, value);
+	case k_atomic_release: return InterlockedExchangeAddRelease64((volatile LONG64*)address, value);
+	default: return InterlockedExchangeAdd64((volatile LONG64*)address, value);
+	}
+}
+
+int32_t atomic_exchange32(volatile int32_t* address, int32_t value, atomic_order_t order)
+{
+	switch (order)
+	{
+	case k_atomic_relaxed: return InterlockedExchangeNoFence((volatile LONG*)address, value);
+	case k_atomic_acquire: return InterlockedExchangeAcquire((volatile LONG*)address, value);
+	default: return InterlockedExchange((volatile LONG*)address, value);
+	}
+}
+
+int64_t atomic_exchange64(volatile int64_t* address, int64_t value, atomic_order_t order)
+{
+	switch (order)
+	{
+	case k_atomic_relaxed: return InterlockedExchangeNoFence64((volatile LONG64*)address, value);
+	case k_atomic_acquire: return InterlockedExchangeAcquire64((volatile LONG64*)address, value);
+	default: return InterlockedExchange64((volatile LONG64*)address, value);
+	}
+}
+
+void* atomic_exchange_ptr(void* volatile* address, void* value, atomic_order_t order)
+{
+	switch (order)
+	{
+	case k_atomic_relaxed: return InterlockedExchangePointerNoFence((PVOID volatile*)address, value);
+	case k_atomic_acquire: return InterlockedExchangePointerAcquire((PVOID volatile*)address, value);
+	default: return InterlockedExchangePointer((PVOID volatile*)address, value);
+	}
+}
+
+bool atomic_compare_exchange32(volatile int32_t* address, int32_t* expected, int32_t desired, atomic_order_t order)
+{
+	LONG old_value;
+	switch (order)
+	{
+	case k_atomic_relaxed:
+		old_value = InterlockedCompareExchangeNoFence((volatile LONG*)address, desired, *expected);
+		break;
+	case k_atomic_acquire:
+		old_value = InterlockedCompareExchangeAcquire((volatile LONG*)address, desired, *expected);
+		break;
+	case k_atomic_release:
+		old_value = InterlockedCompareExchangeRelease((volatile LONG*)address, desired, *expected);
+		break;
+	default:
+		old_value = InterlockedCompareExchange((volatile LONG*)address, desired, *expected);
+		break;
+	}
+	if (old_value == *expected)
+	{
+		return true;
+	}
+	*expected = old_value;
+	return false;
+}
+
+bool atomic_compare_exchange64(volatile int64_t* address, int64_t* expected, int64_t desired, atomic_order_t order)
+{
+	LONG64 old_value;
+	switch (order)
+	{
+	case k_atomic_relaxed:
+		old_value = InterlockedCompareExchangeNoFence64((volatile LONG64*)address, desired, *expected);
+		break;
+	case k_atomic_acquire:
+		old_value = InterlockedCompareExchangeAcquire64((volatile LONG64*)address, desired, *expected);
+		break;
+	case k_atomic_release:
+		old_value = InterlockedCompareExchangeRelease64((volatile LONG64*)address, desired, *expected);
+		break;
+	default:
+		old_value = InterlockedCompareExchange64((volatile LONG64*)address, desired, *expected);
+		break;
+	}
+	if (old_value == *expected)
+	{
+		return true;
+	}
+	*expected = old_value;
+	return false;
+}
+
+bool atomic_compare_exchange_ptr(void* volatile* address, void** expected, void* desired, atomic_order_t order)
+{
+	PVOID old_value;
+	switch (order)
+	{
+	case k_atomic_relaxed:
+		old_value = InterlockedCompareExchangePointerNoFence((PVOID volatile*)address, desired, *expected);
+		break;
+	case k_atomic_acquire:
+		old_value = InterlockedCompareExchangePointerAcquire((PVOID volatile*)address, desired, *expected);
+		break;
+	case k_atomic_release:
+		old_value = InterlockedCompareExchangePointerRelease((PVOID volatile*)address, desired, *expected);
+		break;
+	default:
+		old_value = InterlockedCompareExchangePointer((PVOID volatile*)address, desired, *expected);
+		break;
+	}
+	if (old_value == *expected)
+	{
+		return true;
+	}
+	*expected = old_value;
+	return false;
+}
+
+bool atomic_compare_exchange_tagged(volatile atomic_tagged_ptr_t* address, atomic_tagged_ptr_t* expected, atomic_tagged_ptr_t desired)
+{
+#if defined(_WIN64)
+	// On failure InterlockedCompareExchange128 writes the current value into expected.
+	return InterlockedCompareExchange128((volatile LONG64*)address,
+		(LONG64)desired.tag, (LONG64)desired.ptr, (LONG64*)expected) != 0;
+#else
+	// Pointer and tag are 32 bits each, so the pair fits a 64-bit swap.
+	LONG64 compare = (LONG64)(uint32_t)(uintptr_t)expected->ptr | ((LONG64)expected->tag << 32);
+	LONG64 exchange = (LONG64)(uint32_t)(uintptr_t)desired.ptr | ((LONG64)desired.tag << 32);
+	LONG64 old_value = InterlockedCompareExchange64((volatile LONG64*)address, exchange, compare);
+	if (old_value == compare)
+	{
+		return true;
+	}
+	expected->ptr = (void*)(uintptr_t)(uint32_t)old_value;
+	expected->tag = (uintptr_t)(old_value >> 32);
+	return false;
+#endif
+}
+
+void atomic_fence(atomic_order_t order)
+{
+	if (order == k_atomic_seq_cst)
+	{
+		MemoryBarrier();
+	}
+	else if (order != k_atomic_relaxed)
+	{
+		// x86 and x64 only reorder stores after loads, which acquire and release permit.
+		_ReadWriteBarrier();
+	}
+}
+
+void atomic_pause()
+{
+	YieldProcessor();
+}
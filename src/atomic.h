@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 // Atomic operations on 32-bit integers.
 
 // Increment a number atomically.
@@ -27,3 +30,76 @@ int atomic_load(int* address);
 // Writes an integer.
 // Paired with an atomic_load, can guarantee ordering and visibility.
 void atomic_store(int* address, int value);
+
+// Atomic operations on 32-bit integers, 64-bit integers and pointers
+// with an explicit memory order.
+
+// Memory ordering constraint for an atomic operation.
+typedef enum atomic_order_t
+{
+	// Atomic, but no ordering with respect to other memory operations.
+	k_atomic_relaxed,
+	// No reads or writes after this operation can be moved before it.
+	k_atomic_acquire,
+	// No reads or writes before this operation can be moved after it.
+	k_atomic_release,
+	// Acquire and release, plus a single total order across all threads.
+	k_atomic_seq_cst,
+} atomic_order_t;
+
+// A pointer paired with a tag that changes on each update.
+// Swapped as one unit by atomic_compare_exchange_tagged to defeat ABA.
+// Must be aligned to its size.
+typedef struct atomic_tagged_ptr_t
+{
+	_Alignas(2 * sizeof(void*)) void* ptr;
+	uintptr_t tag;
+} atomic_tagged_ptr_t;
+
+// Reads a value from an address.
+// Order must be relaxed, acquire or seq_cst.
+int32_t atomic_load32(const volatile int32_t* address, atomic_order_t order);
+int64_t atomic_load64(const volatile int64_t* address, atomic_order_t order);
+void* atomic_load_ptr(void* const volatile* address, atomic_order_t order);
+
+// Writes a value to an address.
+// Order must be relaxed, release or seq_cst.
+void atomic_store32(volatile int32_t* address, int32_t value, atomic_order_t order);
+void atomic_store64(volatile int64_t* address, int64_t value, atomic_order_t order);
+void atomic_store_ptr(void* volatile* address, void* value, atomic_order_t order);
+
+// Adds to a number atomically.
+// Returns the old value of the number.
+// Performs the following operation atomically:
+//   old_value = *address; *address += value; return old_value;
+int32_t atomic_fetch_add32(volatile int32_t* address, int32_t value, atomic_order_t order);
+int64_t atomic_fetch_add64(volatile int64_t* address, int64_t value, atomic_order_t order);
+
+// Replaces a value atomically.
+// Returns the old value.
+// Performs the following operation atomically:
+//   old_value = *address; *address = value; return old_value;
+int32_t atomic_exchange32(volatile int32_t* address, int32_t value, atomic_order_t order);
+int64_t atomic_exchange64(volatile int64_t* address, int64_t value, atomic_order_t order);
+void* atomic_exchange_ptr(void* volatile* address, void* value, atomic_order_t order);
+
+// Compare a value atomically and assign if equal.
+// Returns true if the value was replaced.
+// On failure, expected is updated with the current value.
+// Performs the following operation atomically:
+//   if (*address == *expected) { *address = desired; return true; }
+//   *expected = *address; return false;
+bool atomic_compare_exchange32(volatile int32_t* address, int32_t* expected, int32_t desired, atomic_order_t order);
+bool atomic_compare_exchange64(volatile int64_t* address, int64_t* expected, int64_t desired, atomic_order_t order);
+bool atomic_compare_exchange_ptr(void* volatile* address, void** expected, void* desired, atomic_order_t order);
+
+// Compare a tagged pointer atomically and assign if both pointer and tag are equal.
+// Uses a double-width compare-and-swap. Always sequentially consistent.
+// On failure, expected is updated with the current value.
+bool atomic_compare_exchange_tagged(volatile atomic_tagged_ptr_t* address, atomic_tagged_ptr_t* expected, atomic_tagged_ptr_t desired);
+
+// Memory fence with the specified order.
+void atomic_fence(atomic_order_t order);
+
+// Hint to the processor that the calling thread is spin-waiting.
+void atomic_pause();
@@ -0,0 +1,82 @@
+#include "contention.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "timer.h"
+
+#include <string.h>
+
+static void update_max32(volatile int32_t* address, int32_t value);
+static void update_max64(volatile int64_t* address, int64_t value);
+
+void contention_init(contention_t* contention, const char* name)
+{
+	memset(contention, 0, sizeof(*contention));
+	strncpy_s(contention->name, sizeof(contention->name), name, _TRUNCATE);
+}
+
+void contention_record_wait(contention_t* contention, uint64_t wait_ticks)
+{
+#if CONTENTION_ENABLED
+	atomic_fetch_add64(&contention->acquire_count, 1, k_atomic_relaxed);
+	if (!wait_ticks)
+	{
+		return;
+	}
+
+	int64_t wait_us = (int64_t)timer_ticks_to_us(wait_ticks);
+	atomic_fetch_add64(&contention->contended_count, 1, k_atomic_relaxed);
+	atomic_fetch_add64(&contention->total_wait_us, wait_us, k_atomic_relaxed);
+	update_max64(&contention->max_wait_us, wait_us);
+
+	int bucket = 0;
+	while (bucket < k_contention_histogram_buckets - 1 && (wait_us >> (bucket + 1)) != 0)
+	{
+		++bucket;
+	}
+	atomic_fetch_add64(&contention->wait_histogram[bucket], 1, k_atomic_relaxed);
+#endif
+}
+
+void contention_record_depth(contention_t* contention, int32_t delta)
+{
+#if CONTENTION_ENABLED
+	int32_t depth = atomic_fetch_add32(&contention->depth, delta, k_atomic_relaxed) + delta;
+	update_max32(&contention->max_depth, depth);
+#endif
+}
+
+void contention_print(const contention_t* contention)
+{
+	debug_print(k_print_info, "Contention %s: %lld acquires, %lld contended, %lld us waited, %lld us max wait, %d max depth\n",
+		contention->name,
+		contention->acquire_count,
+		contention->contended_count,
+		contention->total_wait_us,
+		contention->max_wait_us,
+		contention->max_depth);
+
+	for (int i = 0; i < k_contention_histogram_buckets; ++i)
+	{
+		if (contention->wait_histogram[i])
+		{
+			debug_print(k_print_info, "  %6lld+ us: %lld\n", i ? 1LL << i : 0LL, contention->wait_histogram[i]);
+		}
+	}
+}
+
+static void update_max32(volatile int32_t* address, int32_t value)
+{
+	int32_t current = atomic_load32(address, k_atomic_relaxed);
+	while (value > current && !atomic_compare_exchange32(address, &current, value, k_atomic_relaxed))
+	{
+	}
+}
+
+static void update_max64(volatile int64_t* address, int64_t value)
+{
+	int64_t current = atomic_load64(address, k_atomic_relaxed);
+	while (value > current && !atomic_compare_exchange64(address, &current, value, k_atomic_relaxed))
+	{
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+// Lock and queue contention statistics.
+//
+// A contention_t is embedded in whatever owns a lock or queue and is updated
+// by every thread that waits on it. Statistics can be read at any time and
+// exported into a trace capture with trace_add_contention.
+//
+// Define CONTENTION_ENABLED to 0 to compile out all recording.
+
+#ifndef CONTENTION_ENABLED
+#define CONTENTION_ENABLED 1
+#endif
+
+enum
+{
+	k_contention_histogram_buckets = 16,
+	k_contention_name_length = 32,
+};
+
+// Contention statistics for one lock or queue.
+typedef struct contention_t
+{
+	char name[k_contention_name_length];
+	// Number of acquires, and how many of them had to wait.
+	int64_t acquire_count;
+	int64_t contended_count;
+	// Wait time across all contended acquires, in microseconds.
+	int64_t total_wait_us;
+	int64_t max_wait_us;
+	// Bucket N counts waits of 2^N to 2^(N+1) microseconds.
+	// The first bucket also counts shorter waits, the last one also counts longer.
+	int64_t wait_histogram[k_contention_histogram_buckets];
+	// Current and maximum number of items held, for queues.
+	int32_t depth;
+	int32_t max_depth;
+} contention_t;
+
+// Reset statistics and give them a name used in prints and traces.
+// Name is copied and truncated to fit.
+void contention_init(contention_t* contention, const char* name);
+
+// Record one acquire.
+// A wait of zero ticks counts as uncontended.
+// Safe for multiple threads to record at the same time.
+void contention_record_wait(contention_t* contention, uint64_t wait_ticks);
+
+// Record items being added (positive) or removed (negative) from a queue.
+// Safe for multiple threads to record at the same time.
+void contention_record_depth(contention_t* contention, int32_t delta);
+
+// Log statistics to the console.
+void contention_print(const contention_t* contention);
@@ -1,14 +1,100 @@
 #include "debug.h"
 
+#include "atomic.h"
+#include "thread.h"
+
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <DbgHelp.h>
 
+enum
+{
+	// Print types with their own rate limit, one per debug_print_t bit.
+	k_debug_print_type_count = 3,
+	// Bytes of queued prints per thread; a power of two.
+	k_debug_log_ring_size = 64 * 1024,
+	k_debug_log_max_threads = 64,
+	// Largest encoded print, including copied strings; larger ones are formatted up front.
+	k_debug_log_max_record = 1024,
+	// Longest formatted print, and the console write batch.
+	k_debug_log_max_message = 1024,
+	k_debug_log_batch_size = 16 * 1024,
+	k_debug_log_flush_ms = 10,
+};
+
+// Kind of argument a printf conversion consumes.
+typedef enum debug_log_arg_t
+{
+	k_debug_log_arg_none,
+	k_debug_log_arg_int32,
+	k_debug_log_arg_int64,
+	k_debug_log_arg_double,
+	k_debug_log_arg_pointer,
+	k_debug_log_arg_string,
+	// Anything else, such as %n or wide strings; formatted on the calling thread.
+	k_debug_log_arg_unsupported,
+} debug_log_arg_t;
+
+// A queued print. Followed by its arguments in 8 byte slots, in format order.
+// Strings are copied: a slot with the length, then the characters padded to 8 bytes.
+typedef struct debug_log_record_t
+{
+	// Bytes including this header, a multiple of 8.
+	uint32_t size;
+	// Print type, or zero for padding up to the end of the ring.
+	uint32_t type;
+	// Roughly orders prints from different threads. It is taken before the
+	// record is published, so a record can become visible after one with a
+	// later sequence has already been written.
+	int64_t sequence;
+	const char* format;
+} debug_log_record_t;
+
+// Prints queued by one thread. Only the owning thread writes records and
+// counters; only the writer thread advances read_pos.
+typedef struct debug_log_thread_t
+{
+	int64_t write_pos;
+	int64_t read_pos;
+	// Rate limiting, per type, over one second windows.
+	uint64_t window_start_ms;
+	uint32_t window_counts[k_debug_print_type_count];
+	int32_t rate_dropped;
+	int32_t full_dropped;
+	// Drops already reported by the writer thread.
+	int32_t rate_dropped_reported;
+	int32_t full_dropped_reported;
+	_Alignas(8) char ring[k_debug_log_ring_size];
+} debug_log_thread_t;
+
 static uint32_t s_mask = 0xffffffff;
 
+static uint32_t s_rate_limits[k_debug_print_type_count];
+static int32_t s_async;
+static int32_t s_async_stop;
+static thread_t* s_log_thread;
+static DWORD s_log_tls_index;
+static debug_log_thread_t* s_log_threads[k_debug_log_max_threads];
+static int32_t s_log_thread_count;
+static int64_t s_log_sequence;
+
+static void print_now(const char* format, va_list args);
+static void write_console(const char* text, size_t length);
+static debug_log_thread_t* log_thread_get();
+static bool log_rate_limited(debug_log_thread_t* thread, uint32_t type);
+static void log_record(debug_log_thread_t* thread, uint32_t type, const char* format, va_list args);
+static bool log_encode(char* payload, size_t* size, const char* format, va_list args);
+static const char* parse_conversion(const char* format, debug_log_arg_t* kind, int* star_count);
+static int log_writer_thread_func(void* user);
+static const debug_log_record_t* log_peek(debug_log_thread_t* thread);
+static void log_write(char* batch, size_t length);
+static void log_drain();
+static size_t log_format(char* out, size_t out_size, const debug_log_record_t* record);
+
 static LONG debug_exception_handler(LPEXCEPTION_POINTERS info)
 {
 	// XXX: MS uses 0xE06D7363 to indicate C++ language exception.
@@ -19,7 +105,10 @@ static LONG debug_exception_handler(LPEXCEPTION_POINTERS info)
 		return EXCEPTION_EXECUTE_HANDLER;
 	}
 
-	debug_print(k_print_error, "Caught exception!\n");
+	// Written directly: the process may not live long enough for the writer thread.
+	static const char k_message[] = "Caught exception!\n";
+	OutputDebugStringA(k_message);
+	write_console(k_message, sizeof(k_message) - 1);
 
 	HANDLE file = CreateFile(L"ga2022-crash.dmp", GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (file != INVALID_HANDLE_VALUE)
@@ -53,6 +142,61 @@ void debug_set_print_mask(uint32_t mask)
 	s_mask = mask;
 }
 
+void debug_set_print_rate_limit(uint32_t type, uint32_t per_second)
+{
+	for (int i = 0; i < k_debug_print_type_count; ++i)
+	{
+		if (type & (1 << i))
+		{
+			s_rate_limits[i] = per_second;
+		}
+	}
+}
+
+void debug_print_async_start()
+{
+	if (s_log_thread)
+	{
+		return;
+	}
+	s_log_tls_index = TlsAlloc();
+	s_async_stop = 0;
+	s_log_thread = thread_create_ex(log_writer_thread_func, NULL, &(thread_info_t)
+	{
+		.name = "debug print",
+		.priority = k_thread_priority_low,
+	});
+	if (s_log_thread)
+	{
+		atomic_store32(&s_async, 1, k_atomic_release);
+	}
+	else
+	{
+		TlsFree(s_log_tls_index);
+	}
+}
+
+void debug_print_async_stop()
+{
+	if (!s_log_thread)
+	{
+		return;
+	}
+	atomic_store32(&s_async, 0, k_atomic_seq_cst);
+	atomic_store32(&s_async_stop, 1, k_atomic_release);
+	thread_destroy(s_log_thread);
+	s_log_thread = NULL;
+
+	int32_t thread_count = __min(s_log_thread_count, k_debug_log_max_threads);
+	for (int32_t i = 0; i < thread_count; ++i)
+	{
+		VirtualFree(s_log_threads[i], 0, MEM_RELEASE);
+		s_log_threads[i] = NULL;
+	}
+	s_log_thread_count = 0;
+	TlsFree(s_log_tls_index);
+}
+
 void debug_print(uint32_t type, _Printf_format_string_ const char* format, ...)
 {
 	if ((s_mask & type) == 0)
@@ -62,16 +206,19 @@ void debug_print(uint32_t type, _Printf_format_string_ const char* format, ...)
 
 	va_list args;
 	va_start(args, format);
-	char buffer[256];
-	vsnprintf(buffer, sizeof(buffer), format, args);
+	debug_log_thread_t* thread = atomic_load32(&s_async, k_atomic_acquire) ? log_thread_get() : NULL;
+	if (thread)
+	{
+		if (!log_rate_limited(thread, type))
+		{
+			log_record(thread, type, format, args);
+		}
+	}
+	else
+	{
+		print_now(format, args);
+	}
 	va_end(args);
-
-	OutputDebugStringA(buffer);
-
-	DWORD bytes = (DWORD)strlen(buffer);
-	DWORD written = 0;
-	HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
-	WriteConsoleA(out, buffer, bytes, &written, NULL);
 }
 
 int debug_backtrace(void** stack, int stack_capacity)
@@ -90,6 +237,26 @@ void symbol_clean() {
 	SymCleanup(GetCurrentProcess());
 }
 
+bool symbol_get_name(void* address, char* name, size_t name_size)
+{
+	char buffer[sizeof(SYMBOL_INFO) + 256];
+	SYMBOL_INFO* sym_info = (SYMBOL_INFO*)buffer;
+	memset(sym_info, 0, sizeof(SYMBOL_INFO));
+	sym_info->SizeOfStruct = sizeof(SYMBOL_INFO);
+	sym_info->MaxNameLen = 255;
+
+	if (!SymFromAddr(GetCurrentProcess(), (DWORD64)address, NULL, sym_info))
+	{
+		if (name_size)
+		{
+			name[0] = '\0';
+		}
+		return false;
+	}
+	snprintf(name, name_size, "%s", sym_info->Name);
+	return true;
+}
+
 void callstack_print(void* stack[], int stack_count, heap_t* heap) {
 	SYMBOL_INFO* sym_info = (SYMBOL_INFO*)heap_alloc(heap, sizeof(SYMBOL_INFO) + 254, 8);
 	sym_info->SizeOfStruct = sizeof(SYMBOL_INFO);
@@ -123,3 +290,486 @@ void callstack_print(void* stack[], int stack_count, heap_t* heap) {
 	heap_free(heap, sym_info);
 	heap_free(heap, line_info);
 }
+
+static void print_now(const char* format, va_list args)
+{
+	char buffer[256];
+	vsnprintf(buffer, sizeof(buffer), format, args);
+
+	OutputDebugStringA(buffer);
+	write_console(buffer, strlen(buffer));
+}
+
+static void write_console(const char* text, size_t length)
+{
+	DWORD written = 0;
+	HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+	WriteConsoleA(out, text, (DWORD)length, &written, NULL);
+}
+
+// Get the calling thread's print queue, registering it on first use.
+// Returns NULL if the thread can't have one; it then prints immediately.
+static debug_log_thread_t* log_thread_get()
+{
+	// Marks threads past k_debug_log_max_threads.
+	static char s_overflow;
+
+	debug_log_thread_t* thread = TlsGetValue(s_log_tls_index);
+	if (thread)
+	{
+		return thread != (void*)&s_overflow ? thread : NULL;
+	}
+
+	int32_t index = atomic_fetch_add32(&s_log_thread_count, 1, k_atomic_relaxed);
+	thread = index < k_debug_log_max_threads ?
+		VirtualAlloc(NULL, sizeof(debug_log_thread_t), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE) :
+		NULL;
+	if (!thread)
+	{
+		TlsSetValue(s_log_tls_index, &s_overflow);
+		return NULL;
+	}
+	TlsSetValue(s_log_tls_index, thread);
+	atomic_store_ptr((void* volatile*)&s_log_threads[index], thread, k_atomic_release);
+	return thread;
+}
+
+static bool log_rate_limited(debug_log_thread_t* thread, uint32_t type)
+{
+	int index = 0;
+	while (index < k_debug_print_type_count && !(type & (1 << index)))
+	{
+		++index;
+	}
+	if (index == k_debug_print_type_count || !s_rate_limits[index])
+	{
+		return false;
+	}
+
+	uint64_t now = GetTickCount64();
+	if (now - thread->window_start_ms >= 1000)
+	{
+		thread->window_start_ms = now;
+		memset(thread->window_counts, 0, sizeof(thread->window_counts));
+	}
+	if (thread->window_counts[index] >= s_rate_limits[index])
+	{
+		atomic_store32(&thread->rate_dropped, thread->rate_dropped + 1, k_atomic_relaxed);
+		return true;
+	}
+	++thread->window_counts[index];
+	return false;
+}
+
+static void log_record(debug_log_thread_t* thread, uint32_t type, const char* format, va_list args)
+{
+	char payload[k_debug_log_max_record];
+	size_t payload_size = 0;
+	va_list encode_args;
+	va_copy(encode_args, args);
+	bool encoded = log_encode(payload, &payload_size, format, encode_args);
+	va_end(encode_args);
+	if (!encoded)
+	{
+		// Format it here instead and queue the text.
+		int length = vsnprintf(payload + 8, sizeof(payload) - 8, format, args);
+		uint64_t slot = (uint64_t)__min(__max(length, 0), (int)sizeof(payload) - 9);
+		memcpy(payload, &slot, sizeof(slot));
+		payload_size = 8 + ((slot + 1 + 7) & ~7ULL);
+		format = "%s";
+	}
+
+	size_t size = sizeof(debug_log_record_t) + payload_size;
+	int64_t write_pos = thread->write_pos;
+	int64_t read_pos = atomic_load64(&thread->read_pos, k_atomic_acquire);
+	size_t offset = (size_t)(write_pos & (k_debug_log_ring_size - 1));
+	size_t padding = offset + size > k_debug_log_ring_size ? k_debug_log_ring_size - offset : 0;
+	if (write_pos + (int64_t)(padding + size) - read_pos > k_debug_log_ring_size)
+	{
+		// Never block the caller on the console.
+		atomic_store32(&thread->full_dropped, thread->full_dropped + 1, k_atomic_relaxed);
+		return;
+	}
+
+	// Records don't wrap. Only size and type of a padding record are written,
+	// which fit in the 8 bytes that are always left.
+	if (padding)
+	{
+		debug_log_record_t* pad = (debug_log_record_t*)(thread->ring + offset);
+		pad->size = (uint32_t)padding;
+		pad->type = 0;
+		write_pos += padding;
+		offset = 0;
+	}
+
+	debug_log_record_t* record = (debug_log_record_t*)(thread->ring + offset);
+	record->size = (uint32_t)size;
+	record->type = type;
+	record->sequence = atomic_fetch_add64(&s_log_sequence, 1, k_atomic_relaxed);
+	record->format = format;
+	memcpy(record + 1, payload, payload_size);
+	atomic_store64(&thread->write_pos, write_pos + (int64_t)size, k_atomic_release);
+}
+
+// Copy the arguments of a print into 8 byte slots.
+// Returns false if the format has a conversion that can't be deferred or the
+// arguments don't fit in the payload.
+static bool log_encode(char* payload, size_t* size, const char* format, va_list args)
+{
+	size_t used = 0;
+	for (const char* p = strchr(format, '%'); p; p = strchr(p, '%'))
+	{
+		debug_log_arg_t kind;
+		int star_count;
+		p = parse_conversion(p + 1, &kind, &star_count);
+		if (kind == k_debug_log_arg_unsupported || used + 8 * (star_count + 1) > k_debug_log_max_record)
+		{
+			return false;
+		}
+
+		for (int s = 0; s < star_count; ++s)
+		{
+			int64_t value = va_arg(args, int);
+			memcpy(payload + used, &value, 8);
+			used += 8;
+		}
+
+		switch (kind)
+		{
+		case k_debug_log_arg_int32:
+		{
+			int64_t value = va_arg(args, int32_t);
+			memcpy(payload + used, &value, 8);
+			used += 8;
+			break;
+		}
+		case k_debug_log_arg_int64:
+		{
+			int64_t value = va_arg(args, int64_t);
+			memcpy(payload + used, &value, 8);
+			used += 8;
+			break;
+		}
+		case k_debug_log_arg_double:
+		{
+			double value = va_arg(args, double);
+			memcpy(payload + used, &value, 8);
+			used += 8;
+			break;
+		}
+		case k_debug_log_arg_pointer:
+		{
+			uint64_t value = (uintptr_t)va_arg(args, void*);
+			memcpy(payload + used, &value, 8);
+			used += 8;
+			break;
+		}
+		case k_debug_log_arg_string:
+		{
+			// The caller's string may be gone by the time it is formatted.
+			const char* string = va_arg(args, const char*);
+			string = string ? string : "(null)";
+			size_t length = strnlen(string, k_debug_log_max_record);
+			if (used + 8 + length + 1 > k_debug_log_max_record)
+			{
+				return false;
+			}
+			uint64_t slot = length;
+			memcpy(payload + used, &slot, 8);
+			memcpy(payload + used + 8, string, length);
+			payload[used + 8 + length] = '\0';
+			used += 8 + ((length + 1 + 7) & ~(size_t)7);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+	*size = used;
+	return true;
+}
+
+// Parse a printf conversion, starting just past its '%'.
+// Returns a pointer past the conversion, its argument kind and the number of
+// int arguments taken by '*' width and precision.
+static const char* parse_conversion(const char* format, debug_log_arg_t* kind, int* star_count)
+{
+	const char* p = format;
+	*star_count = 0;
+	if (*p == '%')
+	{
+		*kind = k_debug_log_arg_none;
+		return p + 1;
+	}
+
+	while (*p && strchr("-+ #0", *p))
+	{
+		++p;
+	}
+	for (int field = 0; field < 2; ++field)
+	{
+		if (field == 1)
+		{
+			if (*p != '.')
+			{
+				break;
+			}
+			++p;
+		}
+		if (*p == '*')
+		{
+			++*star_count;
+			++p;
+		}
+		while (*p >= '0' && *p <= '9')
+		{
+			++p;
+		}
+	}
+
+	size_t int_size = sizeof(int);
+	bool wide = false;
+	if (p[0] == 'h')
+	{
+		p += p[1] == 'h' ? 2 : 1;
+	}
+	else if (p[0] == 'l' && p[1] == 'l')
+	{
+		int_size = sizeof(long long);
+		p += 2;
+	}
+	else if (p[0] == 'l' || p[0] == 'w')
+	{
+		int_size = sizeof(long);
+		wide = true;
+		++p;
+	}
+	else if (p[0] == 'I' && p[1] == '6' && p[2] == '4')
+	{
+		int_size = 8;
+		p += 3;
+	}
+	else if (p[0] == 'I' && p[1] == '3' && p[2] == '2')
+	{
+		int_size = 4;
+		p += 3;
+	}
+	else if (p[0] == 'I' || p[0] == 'z' || p[0] == 't' || p[0] == 'j')
+	{
+		int_size = p[0] == 'j' ? sizeof(intmax_t) : sizeof(size_t);
+		++p;
+	}
+	else if (p[0] == 'L')
+	{
+		// long double is a double here.
+		++p;
+	}
+
+	char conversion = *p;
+	p += conversion ? 1 : 0;
+	switch (conversion)
+	{
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+		*kind = int_size == 8 ? k_debug_log_arg_int64 : k_debug_log_arg_int32;
+		break;
+	case 'c':
+		*kind = wide ? k_debug_log_arg_unsupported : k_debug_log_arg_int32;
+		break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		*kind = k_debug_log_arg_double;
+		break;
+	case 'p':
+		*kind = k_debug_log_arg_pointer;
+		break;
+	case 's':
+		*kind = wide ? k_debug_log_arg_unsupported : k_debug_log_arg_string;
+		break;
+	default:
+		*kind = k_debug_log_arg_unsupported;
+		break;
+	}
+	return p;
+}
+
+static int log_writer_thread_func(void* user)
+{
+	while (!atomic_load32(&s_async_stop, k_atomic_acquire))
+	{
+		log_drain();
+		thread_sleep(k_debug_log_flush_ms);
+	}
+	log_drain();
+	return 0;
+}
+
+// Get the next queued print of a thread, skipping padding.
+static const debug_log_record_t* log_peek(debug_log_thread_t* thread)
+{
+	while (thread->read_pos != atomic_load64(&thread->write_pos, k_atomic_acquire))
+	{
+		const debug_log_record_t* record = (const debug_log_record_t*)(thread->ring + (thread->read_pos & (k_debug_log_ring_size - 1)));
+		if (record->type)
+		{
+			return record;
+		}
+		atomic_store64(&thread->read_pos, thread->read_pos + record->size, k_atomic_release);
+	}
+	return NULL;
+}
+
+static void log_write(char* batch, size_t length)
+{
+	batch[length] = '\0';
+	OutputDebugStringA(batch);
+	write_console(batch, length);
+}
+
+// Format everything queued, oldest published first across threads, and write it in batches.
+static void log_drain()
+{
+	char batch[k_debug_log_batch_size + 1];
+	size_t length = 0;
+	int32_t thread_count = __min(atomic_load32(&s_log_thread_count, k_atomic_acquire), k_debug_log_max_threads);
+
+	for (;;)
+	{
+		debug_log_thread_t* oldest = NULL;
+		const debug_log_record_t* oldest_record = NULL;
+		for (int32_t i = 0; i < thread_count; ++i)
+		{
+			debug_log_thread_t* thread = atomic_load_ptr((void* const volatile*)&s_log_threads[i], k_atomic_acquire);
+			const debug_log_record_t* record = thread ? log_peek(thread) : NULL;
+			if (record && (!oldest_record || record->sequence < oldest_record->sequence))
+			{
+				oldest = thread;
+				oldest_record = record;
+			}
+		}
+		if (!oldest)
+		{
+			break;
+		}
+
+		if (length + k_debug_log_max_message > k_debug_log_batch_size)
+		{
+			log_write(batch, length);
+			length = 0;
+		}
+		length += log_format(batch + length, k_debug_log_max_message, oldest_record);
+		atomic_store64(&oldest->read_pos, oldest->read_pos + oldest_record->size, k_atomic_release);
+	}
+
+	for (int32_t i = 0; i < thread_count; ++i)
+	{
+		debug_log_thread_t* thread = atomic_load_ptr((void* const volatile*)&s_log_threads[i], k_atomic_acquire);
+		if (!thread)
+		{
+			continue;
+		}
+		int32_t rate_dropped = atomic_load32(&thread->rate_dropped, k_atomic_relaxed);
+		int32_t full_dropped = atomic_load32(&thread->full_dropped, k_atomic_relaxed);
+		if (rate_dropped == thread->rate_dropped_reported && full_dropped == thread->full_dropped_reported)
+		{
+			continue;
+		}
+		if (length + k_debug_log_max_message > k_debug_log_batch_size)
+		{
+			log_write(batch, length);
+			length = 0;
+		}
+		int written = snprintf(batch + length, k_debug_log_max_message, "Dropped %d prints over the rate limit and %d with a full queue\n",
+			rate_dropped - thread->rate_dropped_reported, full_dropped - thread->full_dropped_reported);
+		length += written > 0 ? __min((size_t)written, (size_t)k_debug_log_max_message - 1) : 0;
+		thread->rate_dropped_reported = rate_dropped;
+		thread->full_dropped_reported = full_dropped;
+	}
+
+	if (length)
+	{
+		log_write(batch, length);
+	}
+}
+
+// Format a queued print into out, returning the length written.
+static size_t log_format(char* out, size_t out_size, const debug_log_record_t* record)
+{
+	const char* args = (const char*)(record + 1);
+	size_t length = 0;
+	for (const char* p = record->format; *p && length + 1 < out_size;)
+	{
+		if (*p != '%')
+		{
+			out[length++] = *p++;
+			continue;
+		}
+
+		debug_log_arg_t kind;
+		int star_count;
+		const char* end = parse_conversion(p + 1, &kind, &star_count);
+
+		// Copy the conversion on its own, substituting '*' arguments.
+		char spec[64];
+		size_t spec_length = 0;
+		for (; p < end && spec_length + 16 < sizeof(spec); ++p)
+		{
+			if (*p == '*')
+			{
+				int64_t value;
+				memcpy(&value, args, 8);
+				args += 8;
+				spec_length += snprintf(spec + spec_length, sizeof(spec) - spec_length, "%d", (int)value);
+			}
+			else
+			{
+				spec[spec_length++] = *p;
+			}
+		}
+		spec[spec_length] = '\0';
+		p = end;
+
+		uint64_t slot = 0;
+		if (kind != k_debug_log_arg_none)
+		{
+			memcpy(&slot, args, 8);
+			args += 8;
+		}
+
+		char* dest = out + length;
+		size_t remaining = out_size - length;
+		int written = 0;
+		switch (kind)
+		{
+		case k_debug_log_arg_none:
+			written = snprintf(dest, remaining, "%%");
+			break;
+		case k_debug_log_arg_int32:
+			written = snprintf(dest, remaining, spec, (int32_t)slot);
+			break;
+		case k_debug_log_arg_int64:
+			written = snprintf(dest, remaining, spec, (int64_t)slot);
+			break;
+		case k_debug_log_arg_double:
+		{
+			double value;
+			memcpy(&value, &slot, 8);
+			written = snprintf(dest, remaining, spec, value);
+			break;
+		}
+		case k_debug_log_arg_pointer:
+			written = snprintf(dest, remaining, spec, (void*)(uintptr_t)slot);
+			break;
+		case k_debug_log_arg_string:
+			written = snprintf(dest, remaining, spec, args);
+			args += (size_t)((slot + 1 + 7) & ~7ULL);
+			break;
+		default:
+			break;
+		}
+		if (written > 0)
+		{
+			length += __min((size_t)written, remaining - 1);
+		}
+	}
+	out[length] = '\0';
+	return length;
+}
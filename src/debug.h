@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "heap.h"
 
@@ -22,9 +24,27 @@ void debug_install_exception_handler();
 // See the debug_print().
 void debug_set_print_mask(uint32_t mask);
 
+// Limit how many prints of the given types each thread may make per second.
+// Zero removes the limit. Only applies while printing asynchronously; prints
+// over the limit are dropped and their number reported.
+void debug_set_print_rate_limit(uint32_t type, uint32_t per_second);
+
+// Start writing prints on a background thread.
+// debug_print then only copies the format pointer and arguments into a
+// per-thread queue; formatting and console output happen later, in batches.
+// Prints from one thread stay in order; prints from different threads are only roughly ordered.
+// Before this, and after debug_print_async_stop, prints are written immediately.
+void debug_print_async_start();
+
+// Write out everything queued and go back to printing immediately.
+// Other threads must have stopped printing.
+void debug_print_async_stop();
+
 // Log a message to the console.
 // Message may be dropped if type is not in the active mask.
-// See debug_set_print_mask.
+// While printing asynchronously, format must be a string literal or otherwise
+// outlive the print, and messages may also be dropped if a thread's queue fills.
+// See debug_set_print_mask and debug_print_async_start.
 void debug_print(uint32_t type, _Printf_format_string_ const char* format, ...);
 
 // Capture a list of addresses that make up the current function callstack.
@@ -38,5 +58,9 @@ void symbol_init();
 // Deallocates all resources associated with current process handle.
 void symbol_clean();
 
+// Get the name of the function containing address. Requires symbol_init.
+// Returns false and leaves name empty if no symbol is found.
+bool symbol_get_name(void* address, char* name, size_t name_size);
+
 // Print call stack's name with provided function address.
 void callstack_print(void* stack[], int stack_count, heap_t* heap);
@@ -28,3 +28,8 @@ bool event_is_raised(event_t* event)
 {
 	return WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
 }
+
+void event_reset(event_t* event)
+{
+	ResetEvent(event);
+}
@@ -22,3 +22,6 @@ void event_wait(event_t* event);
 
 // Determines if an event is signaled.
 bool event_is_raised(event_t* event);
+
+// Returns a signaled event to the unsignaled state.
+void event_reset(event_t* event);
@@ -0,0 +1,193 @@
+#include "frame_profiler.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+#include "timer.h"
+#include "trace.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	// Frames kept per phase for percentiles; a power of two.
+	k_frame_profiler_window = 1024,
+	// Frames to wait after a hitch before dumping, so the trace shows the recovery too.
+	k_frame_profiler_dump_delay_frames = 30,
+	k_frame_profiler_dump_seconds = 3,
+	// Minimum time between hitch dumps.
+	k_frame_profiler_dump_interval_ms = 10000,
+};
+
+typedef struct frame_phase_history_t
+{
+	// Most recent frame times in microseconds, indexed by frame count.
+	uint64_t samples_us[k_frame_profiler_window];
+	int64_t count;
+	int64_t over_budget_count;
+	int64_t max_us;
+} frame_phase_history_t;
+
+typedef struct frame_profiler_t
+{
+	heap_t* heap;
+	uint64_t budget_us;
+	uint64_t last_frame_ticks;
+	frame_phase_history_t phases[k_frame_phase_count];
+
+	// Hitch dumps, optional. Only touched on the game thread.
+	trace_t* trace;
+	uint64_t hitch_us;
+	int64_t dump_frame;
+	uint64_t last_dump_ticks;
+	int dump_count;
+} frame_profiler_t;
+
+static const char* const k_frame_phase_names[k_frame_phase_count] =
+{
+	"total",
+	"game",
+	"render submit",
+	"gpu wait",
+};
+
+static void phase_record(frame_profiler_t* profiler, frame_phase_history_t* phase, uint64_t us);
+static int sample_compare(const void* a, const void* b);
+
+frame_profiler_t* frame_profiler_create(heap_t* heap, uint64_t budget_us)
+{
+	frame_profiler_t* profiler = heap_alloc(heap, sizeof(frame_profiler_t), 8);
+	memset(profiler, 0, sizeof(*profiler));
+	profiler->heap = heap;
+	profiler->budget_us = budget_us;
+	profiler->dump_frame = -1;
+	return profiler;
+}
+
+void frame_profiler_destroy(frame_profiler_t* profiler)
+{
+	heap_free(profiler->heap, profiler);
+}
+
+void frame_profiler_set_hitch_dump(frame_profiler_t* profiler, trace_t* trace, uint64_t hitch_us)
+{
+	profiler->trace = trace;
+	profiler->hitch_us = hitch_us;
+}
+
+void frame_profiler_add(frame_profiler_t* profiler, frame_phase_t phase, uint64_t ticks)
+{
+	phase_record(profiler, &profiler->phases[phase], timer_ticks_to_us(ticks));
+}
+
+void frame_profiler_frame_end(frame_profiler_t* profiler)
+{
+	uint64_t now = timer_get_ticks();
+	if (!profiler->last_frame_ticks)
+	{
+		profiler->last_frame_ticks = now;
+		return;
+	}
+	uint64_t frame_us = timer_ticks_to_us(now - profiler->last_frame_ticks);
+	profiler->last_frame_ticks = now;
+
+	frame_phase_history_t* total = &profiler->phases[k_frame_phase_total];
+	phase_record(profiler, total, frame_us);
+	if (!profiler->trace)
+	{
+		return;
+	}
+
+	if (profiler->hitch_us && frame_us > profiler->hitch_us)
+	{
+		TRACE_INSTANT(profiler->trace, "frame hitch");
+		bool rate_limited = profiler->last_dump_ticks &&
+			timer_ticks_to_ms(now - profiler->last_dump_ticks) < k_frame_profiler_dump_interval_ms;
+		if (profiler->dump_frame < 0 && !rate_limited)
+		{
+			debug_print(k_print_warning, "Frame hitch: %llu us, writing trace\n", frame_us);
+			profiler->dump_frame = total->count + k_frame_profiler_dump_delay_frames;
+		}
+	}
+
+	if (profiler->dump_frame >= 0 && total->count >= profiler->dump_frame)
+	{
+		char path[64];
+		sprintf_s(path, sizeof(path), "hitch_%d.json", profiler->dump_count++);
+		trace_flight_recorder_dump(profiler->trace, path, k_frame_profiler_dump_seconds);
+		profiler->dump_frame = -1;
+		profiler->last_dump_ticks = timer_get_ticks();
+	}
+}
+
+void frame_profiler_get_stats(frame_profiler_t* profiler, frame_phase_t phase, frame_stats_t* stats)
+{
+	frame_phase_history_t* history = &profiler->phases[phase];
+	memset(stats, 0, sizeof(*stats));
+	stats->frame_count = atomic_load64(&history->count, k_atomic_acquire);
+	stats->over_budget_count = atomic_load64(&history->over_budget_count, k_atomic_relaxed);
+	stats->max_ever_us = (uint64_t)atomic_load64(&history->max_us, k_atomic_relaxed);
+
+	// Sort a copy of the window. The recording thread may overwrite the oldest
+	// samples meanwhile, which only blurs the window's edge.
+	int count = (int)__min(stats->frame_count, (int64_t)k_frame_profiler_window);
+	if (count == 0)
+	{
+		return;
+	}
+	uint64_t* sorted = heap_alloc(profiler->heap, sizeof(uint64_t) * count, 8);
+	memcpy(sorted, history->samples_us, sizeof(uint64_t) * count);
+	qsort(sorted, count, sizeof(uint64_t), sample_compare);
+	stats->p50_us = sorted[(count - 1) * 50 / 100];
+	stats->p95_us = sorted[(count - 1) * 95 / 100];
+	stats->p99_us = sorted[(count - 1) * 99 / 100];
+	stats->max_us = sorted[count - 1];
+	heap_free(profiler->heap, sorted);
+}
+
+void frame_profiler_print(frame_profiler_t* profiler)
+{
+	for (int i = 0; i < k_frame_phase_count; ++i)
+	{
+		frame_stats_t stats;
+		frame_profiler_get_stats(profiler, i, &stats);
+		if (stats.frame_count == 0)
+		{
+			continue;
+		}
+		// One print per line, so a rate-limited print drops the whole line.
+		char line[256];
+		int length = snprintf(line, sizeof(line), "Frame %s: %lld frames, p50 %llu us, p95 %llu us, p99 %llu us, max %llu us, max ever %llu us",
+			k_frame_phase_names[i], stats.frame_count, stats.p50_us, stats.p95_us, stats.p99_us, stats.max_us, stats.max_ever_us);
+		if (i == k_frame_phase_total && length > 0 && length < (int)sizeof(line))
+		{
+			snprintf(line + length, sizeof(line) - length, ", %lld over %llu us budget", stats.over_budget_count, profiler->budget_us);
+		}
+		debug_print(k_print_info, "%s\n", line);
+	}
+}
+
+static void phase_record(frame_profiler_t* profiler, frame_phase_history_t* phase, uint64_t us)
+{
+	int64_t count = phase->count;
+	phase->samples_us[count & (k_frame_profiler_window - 1)] = us;
+	if ((int64_t)us > phase->max_us)
+	{
+		atomic_store64(&phase->max_us, (int64_t)us, k_atomic_relaxed);
+	}
+	if (us > profiler->budget_us)
+	{
+		atomic_store64(&phase->over_budget_count, phase->over_budget_count + 1, k_atomic_relaxed);
+	}
+	atomic_store64(&phase->count, count + 1, k_atomic_release);
+}
+
+static int sample_compare(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
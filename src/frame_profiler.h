@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+
+// Frame time statistics and hitch detection.
+//
+// Each phase of a frame keeps a rolling window of recent times, from which
+// percentiles are computed on request. Frames longer than the budget are
+// counted; frames longer than the hitch threshold can write out the trace
+// flight recorder so the cause can be found afterwards.
+
+// Handle to a frame profiler.
+typedef struct frame_profiler_t frame_profiler_t;
+
+typedef struct heap_t heap_t;
+typedef struct trace_t trace_t;
+
+// Parts of a frame that are timed.
+typedef enum frame_phase_t
+{
+	// Whole frame on the game thread, from one frame_profiler_frame_end to the next.
+	k_frame_phase_total,
+	// Game update on the game thread, including pushing render commands.
+	k_frame_phase_game,
+	// Render thread processing a frame's commands, not counting waits for more.
+	k_frame_phase_render_submit,
+	// Render thread inside gpu_frame_end, waiting on the swap chain and fences.
+	k_frame_phase_gpu_wait,
+
+	k_frame_phase_count,
+} frame_phase_t;
+
+// Statistics for one phase over the rolling window, in microseconds.
+typedef struct frame_stats_t
+{
+	uint64_t p50_us;
+	uint64_t p95_us;
+	uint64_t p99_us;
+	// Longest in the window, and since the profiler was created.
+	uint64_t max_us;
+	uint64_t max_ever_us;
+	// Frames recorded since the profiler was created.
+	int64_t frame_count;
+	// Frames longer than the budget since the profiler was created.
+	int64_t over_budget_count;
+} frame_stats_t;
+
+// Create a frame profiler. Frames longer than budget_us are counted as over budget.
+frame_profiler_t* frame_profiler_create(heap_t* heap, uint64_t budget_us);
+
+// Destroy a frame profiler.
+void frame_profiler_destroy(frame_profiler_t* profiler);
+
+// Write the trace's flight recorder to hitch_<n>.json shortly after any frame
+// longer than hitch_us, so the file covers the frames before and after it.
+// The flight recorder must be running. Dumps are rate limited.
+void frame_profiler_set_hitch_dump(frame_profiler_t* profiler, trace_t* trace, uint64_t hitch_us);
+
+// Record the time one phase of a frame took.
+// Each phase must be recorded from only one thread.
+void frame_profiler_add(frame_profiler_t* profiler, frame_phase_t phase, uint64_t ticks);
+
+// Mark the end of a frame on the game thread.
+// Records the total frame time and checks it against the budget and hitch threshold.
+void frame_profiler_frame_end(frame_profiler_t* profiler);
+
+// Get statistics for a phase. Safe to call from any thread.
+void frame_profiler_get_stats(frame_profiler_t* profiler, frame_phase_t phase, frame_stats_t* stats);
+
+// Print statistics for every phase.
+void frame_profiler_print(frame_profiler_t* profiler);
@@ -1,7 +1,7 @@
 # include "frogger_game.h"
 
+#include "asset.h"
 #include "ecs.h"
-#include "fs.h"
 #include "gpu.h"
 #include "heap.h"
 #include "render.h"
@@ -66,7 +66,7 @@ typedef struct name_component_t
 
 typedef struct frogger_game_t {
 	heap_t* heap;
-	fs_t* fs;
+	asset_cache_t* assets;
 	wm_window_t* window;
 	render_t* render;
 
@@ -90,8 +90,8 @@ typedef struct frogger_game_t {
 	gpu_mesh_info_t enemy_mesh;
 	gpu_shader_info_t enemy_shader;
 
-	fs_work_t* vertex_shader_work;
-	fs_work_t* fragment_shader_work;
+	asset_t* vertex_shader;
+	asset_t* fragment_shader;
 
 	int row_count;
 	uint64_t row_timer[16];
@@ -121,10 +121,10 @@ static bool check_collide(transform_t* player, transform_t* enemy);
 
 // Game LEVEL
 
-frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* render){
+frogger_game_t* frogger_game_create(heap_t* heap, asset_cache_t* assets, wm_window_t* window, render_t* render){
 	frogger_game_t* game = heap_alloc(heap, sizeof(frogger_game_t), 8);
 	game->heap = heap;
-	game->fs = fs;
+	game->assets = assets;
 	game->window = window;
 	game->render = render;
 
@@ -173,16 +173,16 @@ void frogger_game_update(frogger_game_t* game) {
 }
 
 static void load_resources(frogger_game_t* game) {
-	game->vertex_shader_work = fs_read(game->fs, "shaders/triangle.vert.spv", game->heap, false, false);
-	game->fragment_shader_work = fs_read(game->fs, "shaders/triangle.frag.spv", game->heap, false, false);
+	game->vertex_shader = asset_acquire_mapped(game->assets, "shaders/triangle.vert.spv");
+	game->fragment_shader = asset_acquire_mapped(game->assets, "shaders/triangle.frag.spv");
 	
 	load_player(game);
 	load_enemy(game);
 }
 
 static void unload_resources(frogger_game_t* game) {
-	fs_work_destroy(game->fragment_shader_work);
-	fs_work_destroy(game->vertex_shader_work);
+	asset_release(game->fragment_shader);
+	asset_release(game->vertex_shader);
 }
 
 static void draw_models(frogger_game_t* game) {
@@ -244,10 +244,10 @@ static void spawn_camera(frogger_game_t* game)
 static void load_player(frogger_game_t* game) {
 	game->player_shader = (gpu_shader_info_t)
 	{
-		.vertex_shader_data = fs_work_get_buffer(game->vertex_shader_work),
-		.vertex_shader_size = fs_work_get_size(game->vertex_shader_work),
-		.fragment_shader_data = fs_work_get_buffer(game->fragment_shader_work),
-		.fragment_shader_size = fs_work_get_size(game->fragment_shader_work),
+		.vertex_shader_data = asset_get_data(game->vertex_shader),
+		.vertex_shader_size = asset_get_size(game->vertex_shader),
+		.fragment_shader_data = asset_get_data(game->fragment_shader),
+		.fragment_shader_size = asset_get_size(game->fragment_shader),
 		.uniform_buffer_count = 1,
 	};
 
@@ -392,10 +392,10 @@ static void update_players(frogger_game_t* game)
 static void load_enemy(frogger_game_t* game) {
 	game->enemy_shader = (gpu_shader_info_t)
 	{
-		.vertex_shader_data = fs_work_get_buffer(game->vertex_shader_work),
-		.vertex_shader_size = fs_work_get_size(game->vertex_shader_work),
-		.fragment_shader_data = fs_work_get_buffer(game->fragment_shader_work),
-		.fragment_shader_size = fs_work_get_size(game->fragment_shader_work),
+		.vertex_shader_data = asset_get_data(game->vertex_shader),
+		.vertex_shader_size = asset_get_size(game->vertex_shader),
+		.fragment_shader_data = asset_get_data(game->fragment_shader),
+		.fragment_shader_size = asset_get_size(game->fragment_shader),
 		.uniform_buffer_count = 1,
 	};
 
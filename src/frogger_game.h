@@ -17,13 +17,13 @@
 
 typedef struct frogger_game_t frogger_game_t;
 
-typedef struct fs_t fs_t;
+typedef struct asset_cache_t asset_cache_t;
 typedef struct heap_t heap_t;
 typedef struct render_t render_t;
 typedef struct wm_window_t wm_window_t;
 
 // Create an instance of frogger game.
-frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* render);
+frogger_game_t* frogger_game_create(heap_t* heap, asset_cache_t* assets, wm_window_t* window, render_t* render);
 
 // Destroy an instance of frogger game.
 void frogger_game_destroy(frogger_game_t* game);
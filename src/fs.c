@@ -1,131 +1,628 @@
 #include "fs.h"
 
+#include "atomic.h"
 #include "event.h"
 #include "heap.h"
 #include "queue.h"
 #include "thread.h"
+#include "trace.h"
 #include "lz4/lz4.h"
+#include "lz4/xxhash.h"
 #include "debug.h"
 
+#include <stdio.h>
 #include <string.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+enum
+{
+	k_fs_max_compress_threads = 8,
+	k_fs_chunk_size = 256 * 1024,
+	k_fs_max_completions = 64,
+	k_fs_archive_alignment = 16,
+	k_fs_archive_entry_compressed = 1,
+	k_fs_priority_count = 3,
+	// One start in this many takes the lowest priority work waiting, so none starves.
+	k_fs_priority_boost_interval = 8,
+	k_fs_append_buffer_size = 64 * 1024,
+};
+
+typedef enum fs_work_state_t
+{
+	k_fs_work_state_queued,
+	k_fs_work_state_started,
+	k_fs_work_state_cancelled,
+} fs_work_state_t;
+
+// Completion port keys for packets the file thread receives.
+enum
+{
+	k_fs_completion_key_io,
+	k_fs_completion_key_submit,
+	k_fs_completion_key_stop,
+};
+
+// "GAZ1" at the start of a compressed file.
+static const uint32_t k_fs_chunk_magic = 0x315a4147;
+// Set in a chunk's compressed size when it is stored uncompressed.
+static const uint32_t k_fs_chunk_stored = 0x80000000;
+
+// Header of a compressed file.
+// Followed by chunk_count 32-bit compressed chunk sizes, then the chunks themselves.
+// Each chunk holds k_fs_chunk_size bytes of the file (the last may hold fewer),
+// compressed independently with LZ4 so chunks can be processed in parallel.
+typedef struct fs_chunk_header_t
+{
+	uint32_t magic;
+	uint32_t chunk_size;
+	uint64_t uncompressed_size;
+	uint32_t chunk_count;
+	uint32_t reserved;
+} fs_chunk_header_t;
+
+// "GAA1" at the start of an archive.
+static const uint32_t k_fs_archive_magic = 0x31414147;
+
+// Header of an archive.
+// Followed by entry_count entries sorted by path hash, then names_size bytes of
+// null-terminated paths, then each entry's data at a k_fs_archive_alignment offset.
+typedef struct fs_archive_header_t
+{
+	uint32_t magic;
+	uint32_t entry_count;
+	uint32_t names_size;
+	uint32_t reserved;
+} fs_archive_header_t;
+
+typedef struct fs_archive_entry_t
+{
+	// XXH64 of the path, relative to the packed directory with forward slashes.
+	uint64_t hash;
+	uint64_t offset;
+	uint64_t size;
+	uint32_t name_offset;
+	// Compressed entries are stored in the chunk format above.
+	uint32_t flags;
+} fs_archive_entry_t;
+
+typedef struct fs_batch_t
+{
+	fs_t* fs;
+	fs_work_t* works;
+	int count;
+	// Works not yet complete; the last to finish raises done.
+	int32_t remaining;
+	event_t* done;
+} fs_batch_t;
+
+// Submission order of a batched read.
+typedef struct fs_batch_slot_t
+{
+	uint64_t offset;
+	int index;
+} fs_batch_slot_t;
+
+// Entries and names gathered while packing an archive.
+typedef struct fs_pack_list_t
+{
+	heap_t* heap;
+	fs_archive_entry_t* entries;
+	uint32_t entry_count;
+	uint32_t entry_capacity;
+	char* names;
+	uint32_t names_size;
+	uint32_t names_capacity;
+} fs_pack_list_t;
+
+// Mounted archive. The table of contents is kept in memory for the life of the file system.
+typedef struct fs_archive_t
+{
+	HANDLE handle;
+	fs_archive_entry_t* entries;
+	uint32_t entry_count;
+	char* names;
+	uint32_t names_size;
+} fs_archive_t;
+
 typedef struct fs_t
 {
 	heap_t* heap;
-	queue_t* file_queue;
+	// One queue per priority, served highest first.
+	queue_t* file_queues[k_fs_priority_count];
+	uint32_t file_start_count;
 	thread_t* file_thread;
+	// Overlapped I/O completions and wakeups for the file thread.
+	HANDLE completion_port;
+	int queue_capacity;
+	fs_archive_t archive;
 	queue_t* compress_queue;
-	thread_t* compress_thread;
+	thread_t* compress_threads[k_fs_max_compress_threads];
+	int compress_thread_count;
+	// Number of work items submitted but not yet done.
+	int32_t pending_count;
+	// Optional; records a flow from each submit to its completion.
+	trace_t* trace;
 } fs_t;
 
 typedef enum fs_work_op_t
 {
 	k_fs_work_op_read,
 	k_fs_work_op_write,
+	k_fs_work_op_stream,
+	k_fs_work_op_map,
+	k_fs_work_op_save,
+	k_fs_work_op_append,
 } fs_work_op_t;
 
-typedef enum fs_comp_op_t
-{
-	k_fs_work_op_compress,
-	k_fs_work_op_decompress,
-} fs_comp_op_t;
-
 typedef struct fs_work_t
 {
+	fs_t* fs;
 	heap_t* heap;
 	fs_work_op_t op;
-	fs_comp_op_t op_comp;
 	char path[1024];
 	bool null_terminate;
 	bool use_compression;
+	// Saves flush the temporary file to disk before it replaces the destination.
+	bool flush;
 	void* buffer;
 	size_t size;
-	size_t size_comp;
+	void* compressed_buffer;
+	size_t compressed_size;
+	// Chunks of a compressed file, claimed one at a time by compress threads.
+	int chunk_count;
+	int32_t next_chunk;
+	int32_t active_helpers;
+	size_t* chunk_offsets;
+	fs_stream_t* stream;
+	// Batch the work belongs to, which is signaled in place of done.
+	fs_batch_t* batch;
+	fs_priority_t priority;
+	// Set once the file thread starts the work or it is cancelled, whichever is first.
+	int32_t state;
+	// Open file and request state while overlapped I/O is in flight.
+	HANDLE handle;
+	OVERLAPPED overlapped;
 	event_t* done;
-	event_t* compress_done;
 	int result;
 } fs_work_t;
 
+typedef struct fs_stream_t
+{
+	// Work object that carries requests for the next piece to the file thread.
+	fs_work_t work;
+	void* handle;
+	bool is_open;
+	// Pieces double-buffer: the caller holds front while the file thread fills back.
+	void* front;
+	void* back;
+	size_t back_size;
+	// Compressed streams read the chunk table up front and one chunk at a time after.
+	uint32_t* chunk_sizes;
+	void* chunk_buffer;
+	int chunk_index;
+} fs_stream_t;
+
+typedef struct fs_append_t
+{
+	// Work object that carries each combined write to the file thread.
+	// Its handle stays open, and its buffer is the one being written.
+	fs_work_t work;
+	bool is_open;
+	// Discard existing contents when the file is opened.
+	bool truncate;
+	uint64_t offset;
+	// Appends are combined here until it fills or is flushed.
+	char* pending;
+	size_t pending_size;
+	char* writing;
+} fs_append_t;
+
 static int file_thread_func(void* user);
 static int compress_thread_func(void* user);
+static void work_complete(fs_work_t* work);
+static void chunks_dispatch(fs_work_t* work, bool may_block);
+static void chunks_help(fs_work_t* work);
+static void chunks_compress_begin(fs_work_t* work);
+static bool chunks_compress_alloc(fs_work_t* work);
+static void chunks_compress_pack(fs_work_t* work);
+static void chunk_compress(fs_work_t* work, int index);
+static void chunks_decompress_begin(fs_work_t* work);
+static void stream_read_next(fs_stream_t* stream);
+static void file_map(fs_work_t* work);
+static bool file_read(fs_work_t* work);
+static void file_read_complete(fs_work_t* work, int result, size_t bytes_read);
+static bool file_write(fs_work_t* work);
+static void file_write_complete(fs_work_t* work, int result, size_t bytes_written);
+static bool file_io_begin(fs_work_t* work, HANDLE handle);
+static void file_queue_push(fs_t* fs, fs_work_t* work);
+static void work_trace_submit(fs_work_t* work);
+static fs_work_t* write_submit(fs_t* fs, fs_work_op_t op, const char* path, const void* buffer, size_t size, bool use_compression, bool flush, fs_priority_t priority);
+static int save_commit(fs_work_t* work, int result);
+static bool file_append(fs_work_t* work);
+static void file_append_complete(fs_work_t* work, int result, size_t bytes_written);
+static bool chunks_compress_now(fs_work_t* work);
+static int archive_read_at(HANDLE handle, void* buffer, size_t size, uint64_t offset);
+static int archive_entry_compare(const void* a, const void* b);
+static const fs_archive_entry_t* archive_find(fs_t* fs, const char* path);
+static int batch_slot_compare(const void* a, const void* b);
+static int pack_collect(fs_pack_list_t* list, const char* directory, const char* prefix);
+static void pack_list_free(fs_pack_list_t* list);
+static int pack_write_at(HANDLE handle, const void* buffer, size_t size, uint64_t offset);
 
 
 fs_t* fs_create(heap_t* heap, int queue_capacity)
 {
 	fs_t* fs = heap_alloc(heap, sizeof(fs_t), 8);
 	fs->heap = heap;
-	fs->file_queue = queue_create(heap, queue_capacity);
-	fs->file_thread = thread_create(file_thread_func, fs);
+	fs->pending_count = 0;
+	fs->trace = NULL;
+	memset(&fs->archive, 0, sizeof(fs->archive));
+	fs->queue_capacity = queue_capacity;
+	fs->completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	const char* queue_names[k_fs_priority_count] = { "fs critical", "fs normal", "fs background" };
+	for (int i = 0; i < k_fs_priority_count; ++i)
+	{
+		fs->file_queues[i] = queue_create(heap, queue_capacity);
+		queue_set_name(fs->file_queues[i], queue_names[i]);
+	}
+	fs->file_start_count = 0;
+	thread_info_t file_thread_info = { .name = "fs file" };
+	fs->file_thread = thread_create_ex(file_thread_func, fs, &file_thread_info);
+
+	// Leave half the machine for the game and render threads.
+	thread_topology_t topology;
+	thread_get_topology(&topology);
+	fs->compress_thread_count = topology.logical_core_count / 2;
+	fs->compress_thread_count = __max(fs->compress_thread_count, 1);
+	fs->compress_thread_count = __min(fs->compress_thread_count, k_fs_max_compress_threads);
 
 	fs->compress_queue = queue_create(heap, queue_capacity);
-	fs->compress_thread = thread_create(compress_thread_func, fs);
+	queue_set_name(fs->compress_queue, "fs compress");
+	thread_info_t compress_thread_info = { .name = "fs compress", .priority = k_thread_priority_low };
+	for (int i = 0; i < fs->compress_thread_count; ++i)
+	{
+		fs->compress_threads[i] = thread_create_ex(compress_thread_func, fs, &compress_thread_info);
+	}
 
 	return fs;
 }
 
 void fs_destroy(fs_t* fs)
 {
-	queue_push(fs->file_queue, NULL);
+	// Work moves back and forth between the file and compress threads,
+	// so let everything in flight finish before stopping either.
+	while (atomic_load32(&fs->pending_count, k_atomic_acquire) > 0)
+	{
+		thread_sleep(1);
+	}
+
+	PostQueuedCompletionStatus(fs->completion_port, 0, k_fs_completion_key_stop, NULL);
 	thread_destroy(fs->file_thread);
-	queue_destroy(fs->file_queue);
+	for (int i = 0; i < k_fs_priority_count; ++i)
+	{
+		queue_destroy(fs->file_queues[i]);
+	}
+	CloseHandle(fs->completion_port);
 
-	queue_push(fs->compress_queue, NULL);
-	thread_destroy(fs->compress_thread);
+	for (int i = 0; i < fs->compress_thread_count; ++i)
+	{
+		queue_push(fs->compress_queue, NULL);
+	}
+	for (int i = 0; i < fs->compress_thread_count; ++i)
+	{
+		thread_destroy(fs->compress_threads[i]);
+	}
 	queue_destroy(fs->compress_queue);
 
+	if (fs->archive.handle)
+	{
+		CloseHandle(fs->archive.handle);
+		heap_free(fs->heap, fs->archive.entries);
+		heap_free(fs->heap, fs->archive.names);
+	}
+
 	heap_free(fs->heap, fs);
 }
 
+void fs_set_trace(fs_t* fs, trace_t* trace)
+{
+	fs->trace = trace;
+}
+
 fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression)
+{
+	return fs_read_ex(fs, path, heap, null_terminate, use_compression, k_fs_priority_normal);
+}
+
+fs_work_t* fs_read_ex(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression, fs_priority_t priority)
 {
 	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	work->fs = fs;
 	work->heap = heap;
 	work->op = k_fs_work_op_read;
 	strcpy_s(work->path, sizeof(work->path), path);
 	work->buffer = NULL;
 	work->size = 0;
+	work->compressed_buffer = NULL;
+	work->compressed_size = 0;
+	work->chunk_count = 0;
+	work->chunk_offsets = NULL;
+	work->batch = NULL;
+	work->priority = priority;
+	work->state = k_fs_work_state_queued;
 	work->done = event_create();
-	work->compress_done = event_create();
 	work->result = 0;
 	work->null_terminate = null_terminate;
+	work->flush = false;
 	work->use_compression = use_compression;
-	queue_push(fs->file_queue, work);
+	atomic_fetch_add32(&fs->pending_count, 1, k_atomic_relaxed);
+	work_trace_submit(work);
+	file_queue_push(fs, work);
 	return work;
 }
 
 fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression)
+{
+	return fs_write_ex(fs, path, buffer, size, use_compression, k_fs_priority_normal);
+}
+
+fs_work_t* fs_write_ex(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression, fs_priority_t priority)
+{
+	return write_submit(fs, k_fs_work_op_write, path, buffer, size, use_compression, false, priority);
+}
+
+fs_work_t* fs_save(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression, bool flush)
+{
+	return fs_save_ex(fs, path, buffer, size, use_compression, flush, k_fs_priority_normal);
+}
+
+fs_work_t* fs_save_ex(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression, bool flush, fs_priority_t priority)
+{
+	return write_submit(fs, k_fs_work_op_save, path, buffer, size, use_compression, flush, priority);
+}
+
+static fs_work_t* write_submit(fs_t* fs, fs_work_op_t op, const char* path, const void* buffer, size_t size, bool use_compression, bool flush, fs_priority_t priority)
 {
 	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	work->fs = fs;
 	work->heap = fs->heap;
-	work->op = k_fs_work_op_write;
+	work->op = op;
+	work->flush = flush;
 	strcpy_s(work->path, sizeof(work->path), path);
 	work->buffer = (void*)buffer;
 	work->size = size;
+	work->compressed_buffer = NULL;
+	work->compressed_size = 0;
+	work->chunk_count = 0;
+	work->chunk_offsets = NULL;
+	work->batch = NULL;
+	work->priority = priority;
+	work->state = k_fs_work_state_queued;
 	work->done = event_create();
-	work->compress_done = event_create();
 	work->result = 0;
 	work->null_terminate = false;
 	work->use_compression = use_compression;
+	atomic_fetch_add32(&fs->pending_count, 1, k_atomic_relaxed);
+	work_trace_submit(work);
 
+	// Compressed writes go to the compress threads first, which hand them on to the file thread.
 	if (use_compression)
 	{
-		// HOMEWORK 2: Queue file write work on compression queue!
-		work->op_comp = k_fs_work_op_compress;
-		queue_push(fs->compress_queue, work);
-		event_wait(work->compress_done);
-		queue_push(fs->file_queue, work);
+		chunks_compress_begin(work);
 	}
 	else
 	{
-		queue_push(fs->file_queue, work);
+		file_queue_push(fs, work);
+	}
+
+	return work;
+}
+
+fs_append_t* fs_open_append(fs_t* fs, const char* path, heap_t* heap, bool truncate)
+{
+	fs_append_t* append = heap_alloc(heap, sizeof(fs_append_t), 8);
+	memset(append, 0, sizeof(*append));
+	append->work.fs = fs;
+	append->work.heap = heap;
+	append->work.op = k_fs_work_op_append;
+	append->work.priority = k_fs_priority_normal;
+	strcpy_s(append->work.path, sizeof(append->work.path), path);
+	append->work.done = event_create();
+	append->truncate = truncate;
+	append->pending = heap_alloc(heap, k_fs_append_buffer_size, 8);
+	append->writing = heap_alloc(heap, k_fs_append_buffer_size, 8);
+
+	// Nothing in flight yet.
+	event_signal(append->work.done);
+	return append;
+}
+
+void fs_append(fs_append_t* append, const void* data, size_t size)
+{
+	const char* bytes = data;
+	while (size > 0)
+	{
+		size_t copy_size = __min(size, k_fs_append_buffer_size - append->pending_size);
+		memcpy(append->pending + append->pending_size, bytes, copy_size);
+		append->pending_size += copy_size;
+		bytes += copy_size;
+		size -= copy_size;
+
+		if (append->pending_size == k_fs_append_buffer_size)
+		{
+			fs_append_flush(append);
+		}
+	}
+}
+
+void fs_append_flush(fs_append_t* append)
+{
+	if (append->pending_size == 0)
+	{
+		return;
+	}
+
+	// Only one write is in flight at a time, so appends land in order.
+	event_wait(append->work.done);
+	char* buffer = append->writing;
+	append->writing = append->pending;
+	append->pending = buffer;
+	append->work.buffer = append->writing;
+	append->work.size = append->pending_size;
+	append->work.state = k_fs_work_state_queued;
+	append->pending_size = 0;
+
+	event_reset(append->work.done);
+	atomic_fetch_add32(&append->work.fs->pending_count, 1, k_atomic_relaxed);
+	file_queue_push(append->work.fs, &append->work);
+}
+
+int fs_append_get_result(fs_append_t* append)
+{
+	event_wait(append->work.done);
+	return append->work.result;
+}
+
+void fs_append_close(fs_append_t* append)
+{
+	fs_append_flush(append);
+	event_wait(append->work.done);
+	event_destroy(append->work.done);
+	if (append->is_open)
+	{
+		CloseHandle(append->work.handle);
 	}
 
+	heap_t* heap = append->work.heap;
+	heap_free(heap, append->pending);
+	heap_free(heap, append->writing);
+	heap_free(heap, append);
+}
+
+fs_work_t* fs_map(fs_t* fs, const char* path)
+{
+	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	memset(work, 0, sizeof(*work));
+	work->fs = fs;
+	work->heap = fs->heap;
+	work->op = archive_find(fs, path) ? k_fs_work_op_read : k_fs_work_op_map;
+	work->priority = k_fs_priority_normal;
+	strcpy_s(work->path, sizeof(work->path), path);
+	work->done = event_create();
+	atomic_fetch_add32(&fs->pending_count, 1, k_atomic_relaxed);
+	work_trace_submit(work);
+	file_queue_push(fs, work);
 	return work;
 }
 
+fs_batch_t* fs_read_batch(fs_t* fs, const char** paths, int count, heap_t* heap, bool null_terminate, bool use_compression)
+{
+	fs_batch_t* batch = heap_alloc(fs->heap, sizeof(fs_batch_t), 8);
+	batch->fs = fs;
+	batch->count = count;
+	batch->remaining = count;
+	batch->done = event_create();
+	batch->works = heap_alloc(fs->heap, sizeof(fs_work_t) * __max(count, 1), 8);
+	memset(batch->works, 0, sizeof(fs_work_t) * count);
+	if (count == 0)
+	{
+		event_signal(batch->done);
+		return batch;
+	}
+
+	// Archived files go first in archive order so the reads sweep forward through it.
+	fs_batch_slot_t* slots = heap_alloc(fs->heap, sizeof(fs_batch_slot_t) * count, 8);
+	for (int i = 0; i < count; ++i)
+	{
+		fs_work_t* work = &batch->works[i];
+		work->fs = fs;
+		work->heap = heap;
+		work->op = k_fs_work_op_read;
+		work->priority = k_fs_priority_normal;
+		strcpy_s(work->path, sizeof(work->path), paths[i]);
+		work->null_terminate = null_terminate;
+		work->use_compression = use_compression;
+		work->batch = batch;
+
+		const fs_archive_entry_t* entry = archive_find(fs, paths[i]);
+		slots[i].offset = entry ? entry->offset : UINT64_MAX;
+		slots[i].index = i;
+	}
+	qsort(slots, count, sizeof(fs_batch_slot_t), batch_slot_compare);
+
+	void** items = heap_alloc(fs->heap, sizeof(void*) * count, 8);
+	for (int i = 0; i < count; ++i)
+	{
+		items[i] = &batch->works[slots[i].index];
+		work_trace_submit(items[i]);
+	}
+	atomic_fetch_add32(&fs->pending_count, count, k_atomic_relaxed);
+
+	// Push at most a queue's worth at a time and wake the file thread after each,
+	// so it drains the queue while the next slice waits for room.
+	for (int start = 0; start < count; start += fs->queue_capacity)
+	{
+		int slice = __min(count - start, fs->queue_capacity);
+		queue_push_many(fs->file_queues[k_fs_priority_normal], items + start, slice);
+		PostQueuedCompletionStatus(fs->completion_port, 0, k_fs_completion_key_submit, NULL);
+	}
+
+	heap_free(fs->heap, items);
+	heap_free(fs->heap, slots);
+	return batch;
+}
+
+bool fs_batch_is_done(fs_batch_t* batch)
+{
+	return event_is_raised(batch->done);
+}
+
+void fs_batch_wait(fs_batch_t* batch)
+{
+	event_wait(batch->done);
+}
+
+int fs_batch_get_result(fs_batch_t* batch, int index)
+{
+	event_wait(batch->done);
+	return batch->works[index].result;
+}
+
+void* fs_batch_get_buffer(fs_batch_t* batch, int index)
+{
+	event_wait(batch->done);
+	return batch->works[index].buffer;
+}
+
+size_t fs_batch_get_size(fs_batch_t* batch, int index)
+{
+	event_wait(batch->done);
+	return batch->works[index].size;
+}
+
+void fs_batch_destroy(fs_batch_t* batch)
+{
+	event_wait(batch->done);
+	event_destroy(batch->done);
+	for (int i = 0; i < batch->count; ++i)
+	{
+		if (batch->works[i].buffer)
+		{
+			heap_free(batch->works[i].heap, batch->works[i].buffer);
+		}
+	}
+	heap_free(batch->fs->heap, batch->works);
+	heap_free(batch->fs->heap, batch);
+}
+
+bool fs_work_cancel(fs_work_t* work)
+{
+	int32_t state = k_fs_work_state_queued;
+	return work && atomic_compare_exchange32(&work->state, &state, k_fs_work_state_cancelled, k_atomic_seq_cst);
+}
+
 bool fs_work_is_done(fs_work_t* work)
 {
 	return work ? event_is_raised(work->done) : true;
@@ -163,186 +660,1345 @@ void fs_work_destroy(fs_work_t* work)
 	{
 		event_wait(work->done);
 		event_destroy(work->done);
-		heap_free(work->heap, work->buffer);
-		heap_free(work->heap, work);
+		// Writes borrow the caller's buffer.
+		if (work->op == k_fs_work_op_read && work->buffer)
+		{
+			heap_free(work->heap, work->buffer);
+		}
+		else if (work->op == k_fs_work_op_map && work->buffer)
+		{
+			UnmapViewOfFile(work->buffer);
+		}
+		heap_free(work->fs->heap, work);
 	}
 }
 
-static void file_read(fs_work_t* work, fs_t* fs)
+fs_stream_t* fs_open_stream(fs_t* fs, const char* path, heap_t* heap, bool use_compression)
 {
-	wchar_t wide_path[1024];
-	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
+	fs_stream_t* stream = heap_alloc(heap, sizeof(fs_stream_t), 8);
+	memset(stream, 0, sizeof(*stream));
+	stream->work.fs = fs;
+	stream->work.heap = heap;
+	stream->work.op = k_fs_work_op_stream;
+	stream->work.priority = k_fs_priority_normal;
+	strcpy_s(stream->work.path, sizeof(stream->work.path), path);
+	stream->work.use_compression = use_compression;
+	stream->work.stream = stream;
+	stream->work.done = event_create();
+	stream->front = heap_alloc(heap, k_fs_chunk_size, 8);
+	stream->back = heap_alloc(heap, k_fs_chunk_size, 8);
+	if (use_compression)
 	{
-		work->result = -1;
-		event_signal(work->done);
-		return;
+		stream->chunk_buffer = heap_alloc(heap, k_fs_chunk_size, 8);
 	}
 
-	HANDLE handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	if (handle == INVALID_HANDLE_VALUE)
-	{
-		work->result = GetLastError();
-		event_signal(work->done);
-		return;
-	}
+	atomic_fetch_add32(&fs->pending_count, 1, k_atomic_relaxed);
+	file_queue_push(fs, &stream->work);
+	return stream;
+}
 
-	if (!GetFileSizeEx(handle, (PLARGE_INTEGER)&work->size))
+const void* fs_stream_read(fs_stream_t* stream, size_t* size)
+{
+	event_wait(stream->work.done);
+	if (stream->work.result != 0 || stream->back_size == 0)
 	{
-		work->result = GetLastError();
-		CloseHandle(handle);
-		event_signal(work->done);
-		return;
+		*size = 0;
+		return NULL;
 	}
 
-	work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
+	void* piece = stream->back;
+	*size = stream->back_size;
+	stream->back = stream->front;
+	stream->front = piece;
 
-	DWORD bytes_read = 0;
-	if (!ReadFile(handle, work->buffer, (DWORD)work->size, &bytes_read, NULL))
-	{
-		work->result = GetLastError();
-		CloseHandle(handle);
-		event_signal(work->done);
-		return;
-	}
+	event_reset(stream->work.done);
+	atomic_fetch_add32(&stream->work.fs->pending_count, 1, k_atomic_relaxed);
+	file_queue_push(stream->work.fs, &stream->work);
+	return piece;
+}
 
-	work->size = bytes_read;
-	CloseHandle(handle);
+int fs_stream_get_result(fs_stream_t* stream)
+{
+	event_wait(stream->work.done);
+	return stream->work.result;
+}
 
-	if (work->use_compression)
+void fs_stream_close(fs_stream_t* stream)
+{
+	event_wait(stream->work.done);
+	event_destroy(stream->work.done);
+	if (stream->is_open)
 	{
-		// HOMEWORK 2: Queue file read work on decompression queue!
-		work->op_comp = k_fs_work_op_decompress;
-		queue_push(fs->compress_queue, work);
-		event_wait(work->compress_done);
+		CloseHandle(stream->handle);
 	}
 
-	if (work->null_terminate)
+	heap_t* heap = stream->work.heap;
+	if (stream->chunk_sizes)
 	{
-		((char*)work->buffer)[work->size] = 0;
+		heap_free(heap, stream->chunk_sizes);
 	}
-
-	event_signal(work->done);
+	if (stream->chunk_buffer)
+	{
+		heap_free(heap, stream->chunk_buffer);
+	}
+	heap_free(heap, stream->front);
+	heap_free(heap, stream->back);
+	heap_free(heap, stream);
 }
 
-static void file_write(fs_work_t* work)
+int fs_mount_archive(fs_t* fs, const char* path)
 {
+	if (fs->archive.handle)
+	{
+		debug_print(k_print_warning, "Archive mount failed, an archive is already mounted\n");
+		return -1;
+	}
+
 	wchar_t wide_path[1024];
-	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wide_path, (int)_countof(wide_path)) <= 0)
 	{
-		work->result = -1;
-		event_signal(work->done);
-		return;
+		return -1;
 	}
 
-	HANDLE handle = CreateFile(wide_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
-		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	HANDLE handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
 	if (handle == INVALID_HANDLE_VALUE)
 	{
-		work->result = GetLastError();
-		event_signal(work->done);
-		return;
+		return GetLastError();
 	}
 
-	DWORD bytes_written = 0;
-	DWORD size = (DWORD)(work->use_compression ? work->size_comp : work->size);
-	if (!WriteFile(handle, work->buffer, size, &bytes_written, NULL))
+	fs_archive_header_t header;
+	int result = archive_read_at(handle, &header, sizeof(header), 0);
+	if (result == 0 && header.magic != k_fs_archive_magic)
+	{
+		debug_print(k_print_warning, "Archive mount failed, bad header\n");
+		result = -1;
+	}
+	if (result != 0)
 	{
-		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
-		return;
+		return result;
 	}
 
-	if (work->use_compression) {
-		heap_free(work->heap, work->buffer);
-		work->size_comp = bytes_written;
+	size_t entries_size = sizeof(fs_archive_entry_t) * header.entry_count;
+	fs_archive_entry_t* entries = heap_alloc(fs->heap, __max(entries_size, 1), 8);
+	char* names = heap_alloc(fs->heap, (size_t)header.names_size + 1, 8);
+	result = archive_read_at(handle, entries, entries_size, sizeof(header));
+	if (result == 0)
+	{
+		result = archive_read_at(handle, names, header.names_size, sizeof(header) + entries_size);
+	}
+	for (uint32_t i = 0; result == 0 && i < header.entry_count; ++i)
+	{
+		if (entries[i].name_offset >= header.names_size)
+		{
+			debug_print(k_print_warning, "Archive mount failed, bad entry\n");
+			result = -1;
+		}
 	}
-	else work->size = bytes_written;
-
-	CloseHandle(handle);
-
-	event_signal(work->done);
-}
-
-static void file_compress(fs_work_t* work) {
-	int buffer_size = LZ4_compressBound((int)work->size);
-	char* buffer_comp = heap_alloc(work->heap, buffer_size, 8);
-	int comp_size = LZ4_compress_default(work->buffer, buffer_comp, (int)work->size, buffer_size);
 
-	if (!comp_size) {
-		debug_print(k_print_warning, "Compression failed\n");
-		heap_free(work->heap, buffer_comp);
+	// Reads from here on complete on the file thread.
+	if (result == 0 && !CreateIoCompletionPort(handle, fs->completion_port, k_fs_completion_key_io, 0))
+	{
+		result = GetLastError();
 	}
-	else {
-		work->buffer = buffer_comp;
-		work->size_comp = comp_size;
+	if (result != 0)
+	{
+		heap_free(fs->heap, entries);
+		heap_free(fs->heap, names);
+		CloseHandle(handle);
+		return result;
 	}
 
-	event_signal(work->compress_done);
+	names[header.names_size] = 0;
+	fs->archive.handle = handle;
+	fs->archive.entries = entries;
+	fs->archive.entry_count = header.entry_count;
+	fs->archive.names = names;
+	fs->archive.names_size = header.names_size;
+	return 0;
 }
 
-static void file_decompress(fs_work_t* work) {
-	// estimate max 255 times compressed size
-	int buffer_size = 256 * (int)work->size;
-	char* buffer_decomp = heap_alloc(work->heap, buffer_size, 8);
-	int decomp_size = LZ4_decompress_safe((char*)work->buffer, buffer_decomp, (int)work->size, buffer_size);
-
-	if (decomp_size < 0) {
-		debug_print(k_print_warning, "Decompression failed\n");
+int fs_pack_archive(fs_t* fs, heap_t* heap, const char* directory, const char* archive_path, bool use_compression)
+{
+	fs_pack_list_t list = { .heap = heap };
+	int result = pack_collect(&list, directory, "");
+	if (result != 0 || list.entry_count == 0)
+	{
+		pack_list_free(&list);
+		return result ? result : -1;
 	}
 
-	heap_free(work->heap, work->buffer);
-
-	work->buffer = buffer_decomp;
-	work->size = (size_t)decomp_size;
+	// Hash order is the lookup order, so it is also the order data is laid out in.
+	for (uint32_t i = 0; i < list.entry_count; ++i)
+	{
+		fs_archive_entry_t* entry = &list.entries[i];
+		entry->hash = XXH64(list.names + entry->name_offset, strlen(list.names + entry->name_offset), 0);
+	}
+	qsort(list.entries, list.entry_count, sizeof(fs_archive_entry_t), archive_entry_compare);
 
-	event_signal(work->compress_done);
-}
+	wchar_t wide_path[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, archive_path, -1, wide_path, (int)_countof(wide_path)) <= 0)
+	{
+		pack_list_free(&list);
+		return -1;
+	}
+	HANDLE handle = CreateFile(wide_path, GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		pack_list_free(&list);
+		return GetLastError();
+	}
 
-static int file_thread_func(void* user)
-{
-	fs_t* fs = user;
-	while (true)
+	// Data goes first, after space for the table of contents, which is written once offsets are known.
+	uint64_t offset = sizeof(fs_archive_header_t) + sizeof(fs_archive_entry_t) * list.entry_count + list.names_size;
+	for (uint32_t i = 0; result == 0 && i < list.entry_count; ++i)
 	{
-		fs_work_t* work = queue_pop(fs->file_queue);
-		if (work == NULL)
+		fs_archive_entry_t* entry = &list.entries[i];
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%s", directory, list.names + entry->name_offset);
+
+		fs_work_t* read = fs_read(fs, path, heap, false, false);
+		result = fs_work_get_result(read);
+		if (result != 0)
 		{
+			debug_print(k_print_error, "Archive pack failed to read %s\n", path);
+			fs_work_destroy(read);
 			break;
 		}
-		
-		switch (work->op)
+
+		const void* data = read->buffer;
+		entry->size = read->size;
+		fs_work_t compress = { .heap = heap, .buffer = read->buffer, .size = read->size };
+		if (use_compression && read->size && chunks_compress_now(&compress) && compress.compressed_size < read->size)
 		{
-		case k_fs_work_op_read:
-			file_read(work, fs);
-			break;
-		case k_fs_work_op_write:
-			file_write(work);
-			break;
+			data = compress.compressed_buffer;
+			entry->size = compress.compressed_size;
+			entry->flags |= k_fs_archive_entry_compressed;
 		}
-	}
-	return 0;
-}
 
-static int compress_thread_func(void* user) {
-	fs_t* fs = user;
-	while (true)
-	{
-		fs_work_t* work = queue_pop(fs->compress_queue);
-		if (work == NULL)
+		offset = (offset + k_fs_archive_alignment - 1) & ~(uint64_t)(k_fs_archive_alignment - 1);
+		entry->offset = offset;
+		result = pack_write_at(handle, data, (size_t)entry->size, offset);
+		offset += entry->size;
+
+		if (compress.compressed_buffer)
 		{
-			break;
+			heap_free(heap, compress.compressed_buffer);
 		}
+		fs_work_destroy(read);
+	}
 
-		switch (work->op_comp)
+	if (result == 0)
+	{
+		fs_archive_header_t header =
 		{
-		case k_fs_work_op_compress:
-			file_compress(work);
-			break;
-		case k_fs_work_op_decompress:
-			file_decompress(work);
-			break;
+			.magic = k_fs_archive_magic,
+			.entry_count = list.entry_count,
+			.names_size = list.names_size,
+		};
+		result = pack_write_at(handle, &header, sizeof(header), 0);
+	}
+	if (result == 0)
+	{
+		result = pack_write_at(handle, list.entries, sizeof(fs_archive_entry_t) * list.entry_count, sizeof(fs_archive_header_t));
+	}
+	if (result == 0)
+	{
+		result = pack_write_at(handle, list.names, list.names_size, sizeof(fs_archive_header_t) + sizeof(fs_archive_entry_t) * list.entry_count);
+	}
+
+	CloseHandle(handle);
+	pack_list_free(&list);
+	return result;
+}
+
+static void work_complete(fs_work_t* work)
+{
+	if (work->compressed_buffer)
+	{
+		heap_free(work->heap, work->compressed_buffer);
+		work->compressed_buffer = NULL;
+	}
+	if (work->chunk_offsets)
+	{
+		heap_free(work->heap, work->chunk_offsets);
+		work->chunk_offsets = NULL;
+	}
+	if (work->op == k_fs_work_op_read && work->null_terminate && work->buffer)
+	{
+		((char*)work->buffer)[work->size] = 0;
+	}
+
+	fs_t* fs = work->fs;
+	TRACE_SCOPE(fs->trace, "fs complete")
+	{
+		TRACE_FLOW_END(fs->trace, "fs work", (uint64_t)(uintptr_t)work);
+	}
+	if (!work->batch)
+	{
+		event_signal(work->done);
+	}
+	else if (atomic_fetch_add32(&work->batch->remaining, -1, k_atomic_seq_cst) == 1)
+	{
+		event_signal(work->batch->done);
+	}
+	atomic_fetch_add32(&fs->pending_count, -1, k_atomic_release);
+}
+
+static size_t chunk_raw_size(fs_work_t* work, int index)
+{
+	size_t offset = (size_t)index * k_fs_chunk_size;
+	return __min(work->size - offset, (size_t)k_fs_chunk_size);
+}
+
+static size_t chunk_table_size(int chunk_count)
+{
+	return sizeof(fs_chunk_header_t) + sizeof(uint32_t) * chunk_count;
+}
+
+static void chunks_compress_begin(fs_work_t* work)
+{
+	if (!chunks_compress_alloc(work))
+	{
+		work_complete(work);
+		return;
+	}
+	chunks_dispatch(work, true);
+}
+
+static void chunks_compress_end(fs_work_t* work)
+{
+	if (work->result != 0)
+	{
+		work_complete(work);
+		return;
+	}
+	chunks_compress_pack(work);
+	file_queue_push(work->fs, work);
+}
+
+// Compress a work's buffer on the calling thread.
+static bool chunks_compress_now(fs_work_t* work)
+{
+	if (!chunks_compress_alloc(work))
+	{
+		return false;
+	}
+	for (int i = 0; i < work->chunk_count; ++i)
+	{
+		chunk_compress(work, i);
+	}
+	chunks_compress_pack(work);
+	return true;
+}
+
+static bool chunks_compress_alloc(fs_work_t* work)
+{
+	if (work->size > (uint64_t)k_fs_chunk_size * INT32_MAX)
+	{
+		debug_print(k_print_warning, "Compression failed, file too large\n");
+		work->result = -1;
+		return false;
+	}
+
+	// Each chunk compresses into its own worst-case slot after the table.
+	// The slots are packed together once every chunk is done.
+	work->chunk_count = (int)((work->size + k_fs_chunk_size - 1) / k_fs_chunk_size);
+	size_t slot_size = LZ4_COMPRESSBOUND(k_fs_chunk_size);
+	work->compressed_buffer = heap_alloc(work->heap, chunk_table_size(work->chunk_count) + slot_size * work->chunk_count, 8);
+
+	fs_chunk_header_t* header = work->compressed_buffer;
+	header->magic = k_fs_chunk_magic;
+	header->chunk_size = k_fs_chunk_size;
+	header->uncompressed_size = work->size;
+	header->chunk_count = work->chunk_count;
+	header->reserved = 0;
+	return true;
+}
+
+// Pack compressed chunks together, out of their worst-case slots.
+static void chunks_compress_pack(fs_work_t* work)
+{
+	char* buffer = work->compressed_buffer;
+	uint32_t* sizes = (uint32_t*)(buffer + sizeof(fs_chunk_header_t));
+	size_t slot_size = LZ4_COMPRESSBOUND(k_fs_chunk_size);
+	size_t offset = chunk_table_size(work->chunk_count);
+	for (int i = 0; i < work->chunk_count; ++i)
+	{
+		size_t size = sizes[i] & ~k_fs_chunk_stored;
+		memmove(buffer + offset, buffer + chunk_table_size(work->chunk_count) + slot_size * i, size);
+		offset += size;
+	}
+	work->compressed_size = offset;
+}
+
+static void chunk_compress(fs_work_t* work, int index)
+{
+	char* buffer = work->compressed_buffer;
+	uint32_t* sizes = (uint32_t*)(buffer + sizeof(fs_chunk_header_t));
+	size_t slot_size = LZ4_COMPRESSBOUND(k_fs_chunk_size);
+	char* dst = buffer + chunk_table_size(work->chunk_count) + slot_size * index;
+	const char* src = (const char*)work->buffer + (size_t)index * k_fs_chunk_size;
+	int src_size = (int)chunk_raw_size(work, index);
+
+	int comp_size = LZ4_compress_default(src, dst, src_size, (int)slot_size);
+	if (comp_size <= 0 || comp_size >= src_size)
+	{
+		// Incompressible, store it as is.
+		memcpy(dst, src, src_size);
+		sizes[index] = (uint32_t)src_size | k_fs_chunk_stored;
+	}
+	else
+	{
+		sizes[index] = (uint32_t)comp_size;
+	}
+}
+
+static void chunks_decompress_begin(fs_work_t* work)
+{
+	const char* buffer = work->compressed_buffer;
+	const fs_chunk_header_t* header = (const fs_chunk_header_t*)buffer;
+	if (work->compressed_size < sizeof(fs_chunk_header_t) ||
+		header->magic != k_fs_chunk_magic ||
+		header->chunk_size != k_fs_chunk_size ||
+		header->chunk_count != (header->uncompressed_size + k_fs_chunk_size - 1) / k_fs_chunk_size ||
+		work->compressed_size < chunk_table_size(header->chunk_count))
+	{
+		debug_print(k_print_warning, "Decompression failed, bad header\n");
+		work->result = -1;
+		work_complete(work);
+		return;
+	}
+
+	work->chunk_count = header->chunk_count;
+	work->size = (size_t)header->uncompressed_size;
+
+	// Prefix sum of chunk sizes gives each chunk's offset; the extra entry is the end of the file.
+	const uint32_t* sizes = (const uint32_t*)(buffer + sizeof(fs_chunk_header_t));
+	work->chunk_offsets = heap_alloc(work->heap, sizeof(size_t) * (work->chunk_count + 1), 8);
+	work->chunk_offsets[0] = chunk_table_size(work->chunk_count);
+	for (int i = 0; i < work->chunk_count; ++i)
+	{
+		work->chunk_offsets[i + 1] = work->chunk_offsets[i] + (sizes[i] & ~k_fs_chunk_stored);
+	}
+	if (work->chunk_offsets[work->chunk_count] > work->compressed_size)
+	{
+		debug_print(k_print_warning, "Decompression failed, truncated file\n");
+		work->result = -1;
+		work_complete(work);
+		return;
+	}
+
+	// The header records the exact size, so no guessing at the output buffer.
+	work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
+
+	chunks_dispatch(work, false);
+}
+
+static void chunks_decompress_end(fs_work_t* work)
+{
+	if (work->result != 0)
+	{
+		heap_free(work->heap, work->buffer);
+		work->buffer = NULL;
+		work->size = 0;
+	}
+	work_complete(work);
+}
+
+static void chunk_decompress(fs_work_t* work, int index)
+{
+	const char* buffer = work->compressed_buffer;
+	const uint32_t* sizes = (const uint32_t*)(buffer + sizeof(fs_chunk_header_t));
+	const char* src = buffer + work->chunk_offsets[index];
+	int src_size = (int)(work->chunk_offsets[index + 1] - work->chunk_offsets[index]);
+	char* dst = (char*)work->buffer + (size_t)index * k_fs_chunk_size;
+	int dst_size = (int)chunk_raw_size(work, index);
+
+	if (sizes[index] & k_fs_chunk_stored)
+	{
+		if (src_size == dst_size)
+		{
+			memcpy(dst, src, src_size);
+			return;
+		}
+	}
+	else if (LZ4_decompress_safe(src, dst, src_size, dst_size) == dst_size)
+	{
+		return;
+	}
+
+	debug_print(k_print_warning, "Decompression failed\n");
+	atomic_store32(&work->result, -1, k_atomic_relaxed);
+}
+
+// Hand a compressed work's chunks to the compress threads.
+// One helper per thread is queued; each claims chunks until none are left.
+// If may_block is false and the compress queue is full, the caller helps instead.
+static void chunks_dispatch(fs_work_t* work, bool may_block)
+{
+	work->next_chunk = 0;
+	int helpers = __min(work->chunk_count, work->fs->compress_thread_count);
+	work->active_helpers = __max(helpers, 1);
+
+	if (helpers == 0)
+	{
+		chunks_help(work);
+		return;
+	}
+	for (int i = 0; i < helpers; ++i)
+	{
+		if (may_block)
+		{
+			queue_push(work->fs->compress_queue, work);
+		}
+		else if (!queue_try_push(work->fs->compress_queue, work))
+		{
+			chunks_help(work);
+		}
+	}
+}
+
+static void chunks_help(fs_work_t* work)
+{
+	int index;
+	while ((index = atomic_fetch_add32(&work->next_chunk, 1, k_atomic_relaxed)) < work->chunk_count)
+	{
+		if (work->op == k_fs_work_op_write)
+		{
+			chunk_compress(work, index);
+		}
+		else
+		{
+			chunk_decompress(work, index);
+		}
+	}
+
+	// The last helper out finishes the work; every chunk is done by then.
+	if (atomic_fetch_add32(&work->active_helpers, -1, k_atomic_seq_cst) == 1)
+	{
+		if (work->op == k_fs_work_op_write)
+		{
+			chunks_compress_end(work);
+		}
+		else
+		{
+			chunks_decompress_end(work);
+		}
+	}
+}
+
+static const fs_archive_entry_t* archive_find(fs_t* fs, const char* path)
+{
+	if (!fs->archive.handle)
+	{
+		return NULL;
+	}
+
+	char name[1024];
+	size_t length = 0;
+	for (; path[length] && length < sizeof(name) - 1; ++length)
+	{
+		name[length] = path[length] == '\\' ? '/' : path[length];
+	}
+	name[length] = 0;
+	uint64_t hash = XXH64(name, length, 0);
+
+	// Lower bound on the hash, then compare names to rule out collisions.
+	uint32_t low = 0;
+	uint32_t high = fs->archive.entry_count;
+	while (low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		if (fs->archive.entries[mid].hash < hash)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	for (; low < fs->archive.entry_count && fs->archive.entries[low].hash == hash; ++low)
+	{
+		const fs_archive_entry_t* entry = &fs->archive.entries[low];
+		if (strcmp(fs->archive.names + entry->name_offset, name) == 0)
+		{
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static int archive_read_at(HANDLE handle, void* buffer, size_t size, uint64_t offset)
+{
+	OVERLAPPED overlapped = { 0 };
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+	DWORD bytes_read = 0;
+	if (!ReadFile(handle, buffer, (DWORD)size, NULL, &overlapped) && GetLastError() != ERROR_IO_PENDING)
+	{
+		return GetLastError();
+	}
+	if (!GetOverlappedResult(handle, &overlapped, &bytes_read, TRUE))
+	{
+		return GetLastError();
+	}
+	if (bytes_read != size)
+	{
+		debug_print(k_print_warning, "Archive read failed, truncated file\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int archive_entry_compare(const void* a, const void* b)
+{
+	uint64_t hash_a = ((const fs_archive_entry_t*)a)->hash;
+	uint64_t hash_b = ((const fs_archive_entry_t*)b)->hash;
+	return hash_a < hash_b ? -1 : hash_a > hash_b;
+}
+
+static int batch_slot_compare(const void* a, const void* b)
+{
+	const fs_batch_slot_t* slot_a = a;
+	const fs_batch_slot_t* slot_b = b;
+	if (slot_a->offset != slot_b->offset)
+	{
+		return slot_a->offset < slot_b->offset ? -1 : 1;
+	}
+	return slot_a->index - slot_b->index;
+}
+
+// Read an archive entry with one positioned read on the shared archive handle.
+static bool archive_read(fs_work_t* work, const fs_archive_entry_t* entry)
+{
+	// The entry, not the caller, knows how it was stored; see fs_mount_archive.
+	work->use_compression = (entry->flags & k_fs_archive_entry_compressed) != 0;
+	size_t size = (size_t)entry->size;
+	bool null_terminate = work->null_terminate && !work->use_compression;
+	void* buffer = heap_alloc(work->heap, null_terminate ? size + 1 : size, 8);
+	if (work->use_compression)
+	{
+		work->compressed_buffer = buffer;
+	}
+	else
+	{
+		work->buffer = buffer;
+	}
+
+	work->handle = work->fs->archive.handle;
+	memset(&work->overlapped, 0, sizeof(work->overlapped));
+	work->overlapped.Offset = (DWORD)entry->offset;
+	work->overlapped.OffsetHigh = (DWORD)(entry->offset >> 32);
+
+	if (size == 0)
+	{
+		file_read_complete(work, 0, 0);
+		return false;
+	}
+	if (!ReadFile(work->handle, buffer, (DWORD)size, NULL, &work->overlapped) && GetLastError() != ERROR_IO_PENDING)
+	{
+		file_read_complete(work, GetLastError(), 0);
+		return false;
+	}
+	return true;
+}
+
+static int pack_collect(fs_pack_list_t* list, const char* directory, const char* prefix)
+{
+	char pattern[1024];
+	snprintf(pattern, sizeof(pattern), "%s/%s*", directory, prefix);
+	wchar_t wide_pattern[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, pattern, -1, wide_pattern, (int)_countof(wide_pattern)) <= 0)
+	{
+		return -1;
+	}
+
+	WIN32_FIND_DATA find_data;
+	HANDLE find = FindFirstFile(wide_pattern, &find_data);
+	if (find == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	int result = 0;
+	do
+	{
+		char file_name[260 * 3];
+		if (WideCharToMultiByte(CP_UTF8, 0, find_data.cFileName, -1, file_name, (int)sizeof(file_name), NULL, NULL) <= 0)
+		{
+			result = -1;
+			break;
+		}
+		if (strcmp(file_name, ".") == 0 || strcmp(file_name, "..") == 0)
+		{
+			continue;
+		}
+
+		char name[1024];
+		snprintf(name, sizeof(name), "%s%s", prefix, file_name);
+		if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			char sub_prefix[1024];
+			snprintf(sub_prefix, sizeof(sub_prefix), "%s/", name);
+			result = pack_collect(list, directory, sub_prefix);
+			continue;
+		}
+
+		uint32_t name_size = (uint32_t)strlen(name) + 1;
+		if (list->entry_count == list->entry_capacity)
+		{
+			list->entry_capacity = __max(list->entry_capacity * 2, 64);
+			fs_archive_entry_t* entries = heap_alloc(list->heap, sizeof(fs_archive_entry_t) * list->entry_capacity, 8);
+			if (list->entries)
+			{
+				memcpy(entries, list->entries, sizeof(fs_archive_entry_t) * list->entry_count);
+				heap_free(list->heap, list->entries);
+			}
+			list->entries = entries;
+		}
+		if (list->names_size + name_size > list->names_capacity)
+		{
+			list->names_capacity = __max(list->names_capacity * 2, list->names_size + name_size + 4096);
+			char* names = heap_alloc(list->heap, list->names_capacity, 8);
+			if (list->names)
+			{
+				memcpy(names, list->names, list->names_size);
+				heap_free(list->heap, list->names);
+			}
+			list->names = names;
+		}
+
+		list->entries[list->entry_count++] = (fs_archive_entry_t) { .name_offset = list->names_size };
+		memcpy(list->names + list->names_size, name, name_size);
+		list->names_size += name_size;
+	} while (result == 0 && FindNextFile(find, &find_data));
+
+	FindClose(find);
+	return result;
+}
+
+static void pack_list_free(fs_pack_list_t* list)
+{
+	if (list->entries)
+	{
+		heap_free(list->heap, list->entries);
+	}
+	if (list->names)
+	{
+		heap_free(list->heap, list->names);
+	}
+}
+
+static int pack_write_at(HANDLE handle, const void* buffer, size_t size, uint64_t offset)
+{
+	LARGE_INTEGER position;
+	position.QuadPart = (LONGLONG)offset;
+	DWORD bytes_written = 0;
+	if (!SetFilePointerEx(handle, position, NULL, FILE_BEGIN) ||
+		!WriteFile(handle, buffer, (DWORD)size, &bytes_written, NULL))
+	{
+		return GetLastError();
+	}
+	return bytes_written == size ? 0 : -1;
+}
+
+static bool file_read(fs_work_t* work)
+{
+	const fs_archive_entry_t* entry = archive_find(work->fs, work->path);
+	if (entry)
+	{
+		return archive_read(work, entry);
+	}
+
+	wchar_t wide_path[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, (int)_countof(wide_path)) <= 0)
+	{
+		work->result = -1;
+		work_complete(work);
+		return false;
+	}
+
+	HANDLE handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		work->result = GetLastError();
+		work_complete(work);
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(handle, &file_size))
+	{
+		work->result = GetLastError();
+		CloseHandle(handle);
+		work_complete(work);
+		return false;
+	}
+
+	size_t size = (size_t)file_size.QuadPart;
+	bool null_terminate = work->null_terminate && !work->use_compression;
+	void* buffer = heap_alloc(work->heap, null_terminate ? size + 1 : size, 8);
+	if (work->use_compression)
+	{
+		work->compressed_buffer = buffer;
+	}
+	else
+	{
+		work->buffer = buffer;
+	}
+
+	// Nothing to wait for; finish here rather than queue an empty read.
+	if (size == 0)
+	{
+		work->handle = handle;
+		file_read_complete(work, 0, 0);
+		return false;
+	}
+
+	if (!file_io_begin(work, handle))
+	{
+		file_read_complete(work, GetLastError(), 0);
+		return false;
+	}
+	if (!ReadFile(handle, buffer, (DWORD)size, NULL, &work->overlapped) && GetLastError() != ERROR_IO_PENDING)
+	{
+		file_read_complete(work, GetLastError(), 0);
+		return false;
+	}
+	return true;
+}
+
+static void file_read_complete(fs_work_t* work, int result, size_t bytes_read)
+{
+	// The archive handle is shared by every read from it.
+	if (work->handle != work->fs->archive.handle)
+	{
+		CloseHandle(work->handle);
+	}
+	work->handle = NULL;
+
+	if (result != 0)
+	{
+		work->result = result;
+		heap_free(work->heap, work->use_compression ? work->compressed_buffer : work->buffer);
+		work->compressed_buffer = NULL;
+		work->buffer = NULL;
+		work_complete(work);
+		return;
+	}
+
+	if (work->use_compression)
+	{
+		work->compressed_size = bytes_read;
+
+		// Hand off to the compress threads without waiting for them.
+		// If they are all busy and the queue is full, decompress here rather than block file I/O.
+		chunks_decompress_begin(work);
+		return;
+	}
+
+	work->size = bytes_read;
+	work_complete(work);
+}
+
+static void file_map(fs_work_t* work)
+{
+	wchar_t wide_path[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, (int)_countof(wide_path)) <= 0)
+	{
+		work->result = -1;
+		work_complete(work);
+		return;
+	}
+
+	HANDLE handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		work->result = GetLastError();
+		work_complete(work);
+		return;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(handle, &file_size))
+	{
+		work->result = GetLastError();
+		CloseHandle(handle);
+		work_complete(work);
+		return;
+	}
+
+	// Windows refuses to map an empty file; leave the buffer NULL.
+	if (file_size.QuadPart == 0)
+	{
+		CloseHandle(handle);
+		work_complete(work);
+		return;
+	}
+
+	// The view keeps the file and mapping alive, so both handles can be closed right away.
+	HANDLE mapping = CreateFileMapping(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping)
+	{
+		work->result = GetLastError();
+		CloseHandle(handle);
+		work_complete(work);
+		return;
+	}
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view)
+	{
+		work->result = GetLastError();
+	}
+	CloseHandle(mapping);
+	CloseHandle(handle);
+
+	work->buffer = view;
+	work->size = view ? (size_t)file_size.QuadPart : 0;
+	work_complete(work);
+}
+
+static bool file_write(fs_work_t* work)
+{
+	// Saves write beside the destination and replace it once complete.
+	char temp_path[1040];
+	const char* path = work->path;
+	if (work->op == k_fs_work_op_save)
+	{
+		snprintf(temp_path, sizeof(temp_path), "%s.tmp", work->path);
+		path = temp_path;
+	}
+
+	wchar_t wide_path[1040];
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wide_path, (int)_countof(wide_path)) <= 0)
+	{
+		work->result = -1;
+		work_complete(work);
+		return false;
+	}
+
+	HANDLE handle = CreateFile(wide_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		work->result = GetLastError();
+		work_complete(work);
+		return false;
+	}
+
+	const void* buffer = work->use_compression ? work->compressed_buffer : work->buffer;
+	DWORD size = (DWORD)(work->use_compression ? work->compressed_size : work->size);
+	if (!file_io_begin(work, handle))
+	{
+		file_write_complete(work, GetLastError(), 0);
+		return false;
+	}
+	if (!WriteFile(handle, buffer, size, NULL, &work->overlapped) && GetLastError() != ERROR_IO_PENDING)
+	{
+		file_write_complete(work, GetLastError(), 0);
+		return false;
+	}
+	return true;
+}
+
+static void file_write_complete(fs_work_t* work, int result, size_t bytes_written)
+{
+	if (work->op == k_fs_work_op_save)
+	{
+		result = save_commit(work, result);
+	}
+	else
+	{
+		CloseHandle(work->handle);
+	}
+	work->handle = NULL;
+
+	work->result = result;
+	if (work->use_compression)
+	{
+		work->compressed_size = bytes_written;
+	}
+	else
+	{
+		work->size = bytes_written;
+	}
+
+	work_complete(work);
+}
+
+// Close a save's temporary file and move it over the destination, or delete it on failure.
+static int save_commit(fs_work_t* work, int result)
+{
+	if (result == 0 && work->flush && !FlushFileBuffers(work->handle))
+	{
+		result = GetLastError();
+	}
+	CloseHandle(work->handle);
+
+	char temp_path[1040];
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", work->path);
+	wchar_t wide_temp_path[1040];
+	wchar_t wide_path[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, temp_path, -1, wide_temp_path, (int)_countof(wide_temp_path)) <= 0 ||
+		MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, (int)_countof(wide_path)) <= 0)
+	{
+		return -1;
+	}
+
+	if (result == 0 && !MoveFileEx(wide_temp_path, wide_path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		result = GetLastError();
+	}
+	if (result != 0)
+	{
+		DeleteFile(wide_temp_path);
+	}
+	return result;
+}
+
+static bool append_open(fs_append_t* append)
+{
+	fs_work_t* work = &append->work;
+	wchar_t wide_path[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, (int)_countof(wide_path)) <= 0)
+	{
+		work->result = -1;
+		return false;
+	}
+
+	HANDLE handle = CreateFile(wide_path, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		append->truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		work->result = GetLastError();
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(handle, &file_size) ||
+		!CreateIoCompletionPort(handle, work->fs->completion_port, k_fs_completion_key_io, 0))
+	{
+		work->result = GetLastError();
+		CloseHandle(handle);
+		return false;
+	}
+
+	work->handle = handle;
+	append->offset = (uint64_t)file_size.QuadPart;
+	append->is_open = true;
+	return true;
+}
+
+static bool file_append(fs_work_t* work)
+{
+	fs_append_t* append = CONTAINING_RECORD(work, fs_append_t, work);
+	if (!append->is_open && !append_open(append))
+	{
+		work_complete(work);
+		return false;
+	}
+
+	memset(&work->overlapped, 0, sizeof(work->overlapped));
+	work->overlapped.Offset = (DWORD)append->offset;
+	work->overlapped.OffsetHigh = (DWORD)(append->offset >> 32);
+	if (!WriteFile(work->handle, work->buffer, (DWORD)work->size, NULL, &work->overlapped) && GetLastError() != ERROR_IO_PENDING)
+	{
+		work->result = GetLastError();
+		work_complete(work);
+		return false;
+	}
+	return true;
+}
+
+static void file_append_complete(fs_work_t* work, int result, size_t bytes_written)
+{
+	fs_append_t* append = CONTAINING_RECORD(work, fs_append_t, work);
+	append->offset += bytes_written;
+	if (result != 0)
+	{
+		work->result = result;
+	}
+	work_complete(work);
+}
+
+static bool file_io_begin(fs_work_t* work, HANDLE handle)
+{
+	work->handle = handle;
+	memset(&work->overlapped, 0, sizeof(work->overlapped));
+	return CreateIoCompletionPort(handle, work->fs->completion_port, k_fs_completion_key_io, 0) != NULL;
+}
+
+static void file_io_complete(fs_work_t* work, DWORD bytes_transferred)
+{
+	DWORD bytes = bytes_transferred;
+	int result = GetOverlappedResult(work->handle, &work->overlapped, &bytes, FALSE) ? 0 : GetLastError();
+	if (work->op == k_fs_work_op_read)
+	{
+		file_read_complete(work, result, bytes);
+	}
+	else if (work->op == k_fs_work_op_append)
+	{
+		file_append_complete(work, result, bytes);
+	}
+	else
+	{
+		file_write_complete(work, result, bytes);
+	}
+}
+
+// Start a flow that work_complete ends, so submit to completion latency shows in traces.
+static void work_trace_submit(fs_work_t* work)
+{
+	TRACE_SCOPE(work->fs->trace, "fs submit")
+	{
+		TRACE_FLOW_BEGIN(work->fs->trace, "fs work", (uint64_t)(uintptr_t)work);
+	}
+}
+
+static void file_queue_push(fs_t* fs, fs_work_t* work)
+{
+	queue_push(fs->file_queues[work->priority], work);
+	PostQueuedCompletionStatus(fs->completion_port, 0, k_fs_completion_key_submit, NULL);
+}
+
+static bool stream_read_exact(fs_stream_t* stream, void* buffer, size_t size)
+{
+	DWORD bytes_read = 0;
+	if (!ReadFile(stream->handle, buffer, (DWORD)size, &bytes_read, NULL))
+	{
+		stream->work.result = GetLastError();
+		return false;
+	}
+	if (bytes_read != size)
+	{
+		debug_print(k_print_warning, "Stream read failed, truncated file\n");
+		stream->work.result = -1;
+		return false;
+	}
+	return true;
+}
+
+static bool stream_open(fs_stream_t* stream)
+{
+	wchar_t wide_path[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, stream->work.path, -1, wide_path, (int)_countof(wide_path)) <= 0)
+	{
+		stream->work.result = -1;
+		return false;
+	}
+
+	stream->handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (stream->handle == INVALID_HANDLE_VALUE)
+	{
+		stream->work.result = GetLastError();
+		return false;
+	}
+	stream->is_open = true;
+
+	if (stream->work.use_compression)
+	{
+		fs_chunk_header_t header;
+		if (!stream_read_exact(stream, &header, sizeof(header)))
+		{
+			return false;
+		}
+		if (header.magic != k_fs_chunk_magic ||
+			header.chunk_size != k_fs_chunk_size ||
+			header.chunk_count != (header.uncompressed_size + k_fs_chunk_size - 1) / k_fs_chunk_size)
+		{
+			debug_print(k_print_warning, "Stream read failed, bad header\n");
+			stream->work.result = -1;
+			return false;
+		}
+
+		stream->work.chunk_count = header.chunk_count;
+		stream->work.size = (size_t)header.uncompressed_size;
+		stream->chunk_sizes = heap_alloc(stream->work.heap, sizeof(uint32_t) * __max(header.chunk_count, 1), 8);
+		if (!stream_read_exact(stream, stream->chunk_sizes, sizeof(uint32_t) * header.chunk_count))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static void stream_read_next(fs_stream_t* stream)
+{
+	stream->back_size = 0;
+	if (!stream->is_open && !stream_open(stream))
+	{
+		goto done;
+	}
+
+	if (!stream->work.use_compression)
+	{
+		DWORD bytes_read = 0;
+		if (!ReadFile(stream->handle, stream->back, k_fs_chunk_size, &bytes_read, NULL))
+		{
+			stream->work.result = GetLastError();
+		}
+		stream->back_size = bytes_read;
+		goto done;
+	}
+
+	if (stream->chunk_index >= stream->work.chunk_count)
+	{
+		goto done;
+	}
+
+	int index = stream->chunk_index++;
+	uint32_t chunk_size = stream->chunk_sizes[index] & ~k_fs_chunk_stored;
+	int raw_size = (int)chunk_raw_size(&stream->work, index);
+	// Both buffers hold k_fs_chunk_size bytes. Chunks that don't shrink are
+	// stored, so a compressed chunk is always smaller than its raw size.
+	bool stored = (stream->chunk_sizes[index] & k_fs_chunk_stored) != 0;
+	if (chunk_size > k_fs_chunk_size ||
+		(!stored && chunk_size >= (uint32_t)raw_size))
+	{
+		debug_print(k_print_warning, "Stream read failed, bad chunk\n");
+		stream->work.result = -1;
+		goto done;
+	}
+
+	if (stored)
+	{
+		if (chunk_size != (uint32_t)raw_size)
+		{
+			debug_print(k_print_warning, "Stream read failed, bad chunk\n");
+			stream->work.result = -1;
+		}
+		else if (stream_read_exact(stream, stream->back, chunk_size))
+		{
+			stream->back_size = chunk_size;
+		}
+		goto done;
+	}
+
+	if (stream_read_exact(stream, stream->chunk_buffer, chunk_size))
+	{
+		if (LZ4_decompress_safe(stream->chunk_buffer, stream->back, (int)chunk_size, raw_size) == raw_size)
+		{
+			stream->back_size = raw_size;
+		}
+		else
+		{
+			debug_print(k_print_warning, "Decompression failed\n");
+			stream->work.result = -1;
+		}
+	}
+
+done:
+	event_signal(stream->work.done);
+	atomic_fetch_add32(&stream->work.fs->pending_count, -1, k_atomic_release);
+}
+
+static fs_work_t* file_queue_pop(fs_t* fs)
+{
+	bool boost = ++fs->file_start_count % k_fs_priority_boost_interval == 0;
+	for (int i = 0; i < k_fs_priority_count; ++i)
+	{
+		int priority = boost ? k_fs_priority_count - 1 - i : i;
+		fs_work_t* work = queue_try_pop(fs->file_queues[priority]);
+		if (work)
+		{
+			return work;
 		}
 	}
+	return NULL;
+}
+
+static int file_thread_func(void* user)
+{
+	fs_t* fs = user;
+	int in_flight = 0;
+	while (true)
+	{
+		// Start queued work until the in-flight limit is reached.
+		// Anything left waits for a completion to free a slot.
+		while (in_flight < fs->queue_capacity)
+		{
+			fs_work_t* work = file_queue_pop(fs);
+			if (work == NULL)
+			{
+				break;
+			}
+
+			int32_t state = k_fs_work_state_queued;
+			if (work->op != k_fs_work_op_stream &&
+				!atomic_compare_exchange32(&work->state, &state, k_fs_work_state_started, k_atomic_seq_cst))
+			{
+				work->result = ERROR_CANCELLED;
+				work_complete(work);
+				continue;
+			}
+
+			switch (work->op)
+			{
+			case k_fs_work_op_read:
+				in_flight += file_read(work) ? 1 : 0;
+				break;
+			case k_fs_work_op_write:
+			case k_fs_work_op_save:
+				in_flight += file_write(work) ? 1 : 0;
+				break;
+			case k_fs_work_op_append:
+				in_flight += file_append(work) ? 1 : 0;
+				break;
+			case k_fs_work_op_stream:
+				stream_read_next(work->stream);
+				break;
+			case k_fs_work_op_map:
+				file_map(work);
+				break;
+			}
+		}
+
+		TRACE_COUNTER(fs->trace, "fs in flight", in_flight);
+
+		OVERLAPPED_ENTRY entries[k_fs_max_completions];
+		ULONG entry_count = 0;
+		if (!GetQueuedCompletionStatusEx(fs->completion_port, entries, (ULONG)_countof(entries), &entry_count, INFINITE, FALSE))
+		{
+			continue;
+		}
+
+		for (ULONG i = 0; i < entry_count; ++i)
+		{
+			if (entries[i].lpCompletionKey == k_fs_completion_key_stop)
+			{
+				return 0;
+			}
+			if (entries[i].lpCompletionKey == k_fs_completion_key_io)
+			{
+				fs_work_t* work = CONTAINING_RECORD(entries[i].lpOverlapped, fs_work_t, overlapped);
+				file_io_complete(work, entries[i].dwNumberOfBytesTransferred);
+				--in_flight;
+			}
+		}
+	}
+}
+
+static int compress_thread_func(void* user)
+{
+	fs_t* fs = user;
+	while (true)
+	{
+		fs_work_t* work = queue_pop(fs->compress_queue);
+		if (work == NULL)
+		{
+			break;
+		}
+
+		chunks_help(work);
+	}
 	return 0;
 }
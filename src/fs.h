@@ -10,7 +10,26 @@ typedef struct fs_t fs_t;
 // Handle to file work.
 typedef struct fs_work_t fs_work_t;
 
+// Handle to a batch of file reads.
+typedef struct fs_batch_t fs_batch_t;
+
+// Handle to a file opened for appending.
+typedef struct fs_append_t fs_append_t;
+
+// Handle to a streaming file read.
+typedef struct fs_stream_t fs_stream_t;
+
 typedef struct heap_t heap_t;
+typedef struct trace_t trace_t;
+
+// Order in which queued file work is started.
+// Lower priorities still get an occasional turn so they are never starved.
+typedef enum fs_priority_t
+{
+	k_fs_priority_critical,
+	k_fs_priority_normal,
+	k_fs_priority_background,
+} fs_priority_t;
 
 // Create a new file system.
 // Provided heap will be used to allocate space for queue and work buffers.
@@ -20,6 +39,24 @@ fs_t* fs_create(heap_t* heap, int queue_capacity);
 // Destroy a previously created file system.
 void fs_destroy(fs_t* fs);
 
+// Record file work in a trace: a flow from each submit to its completion,
+// and a counter of reads and writes in flight. Call before queueing work.
+void fs_set_trace(fs_t* fs, trace_t* trace);
+
+// Mount a packed archive, see fs_pack_archive.
+// Reads of paths in the archive come from it with one positioned read instead of a file open.
+// Paths not in the archive are read from disk as usual.
+// Archived reads ignore use_compression: each entry is decompressed if and only if it was stored compressed.
+// Must be called before any reads are queued. Only one archive may be mounted.
+// Returns zero on success.
+int fs_mount_archive(fs_t* fs, const char* path);
+
+// Pack every file under a directory into an archive, blocking until done.
+// Files are found in the archive by their path relative to the directory.
+// If use_compression is set, files that shrink are stored compressed.
+// Returns zero on success.
+int fs_pack_archive(fs_t* fs, heap_t* heap, const char* directory, const char* archive_path, bool use_compression);
+
 // Queue a file read.
 // File at the specified path will be read in full.
 // Memory for the file will be allocated out of the provided heap.
@@ -27,11 +64,86 @@ void fs_destroy(fs_t* fs);
 // Returns a work object.
 fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression);
 
+// Queue a file read with a priority other than normal.
+fs_work_t* fs_read_ex(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression, fs_priority_t priority);
+
+// Queue reads of several files at once, completing together.
+// Reads may be issued in any order; files in a mounted archive are read in archive order.
+// Memory for the files will be allocated out of the provided heap and freed with the batch.
+// Returns a batch object.
+fs_batch_t* fs_read_batch(fs_t* fs, const char** paths, int count, heap_t* heap, bool null_terminate, bool use_compression);
+
+// If true, every read in the batch is complete.
+bool fs_batch_is_done(fs_batch_t* batch);
+
+// Block for every read in the batch to complete.
+void fs_batch_wait(fs_batch_t* batch);
+
+// Get the error code for a read in the batch, by index into the paths it was queued with.
+// A value of zero generally indicates success.
+int fs_batch_get_result(fs_batch_t* batch, int index);
+
+// Get the buffer for a read in the batch, by index into the paths it was queued with.
+void* fs_batch_get_buffer(fs_batch_t* batch, int index);
+
+// Get the size for a read in the batch, by index into the paths it was queued with.
+size_t fs_batch_get_size(fs_batch_t* batch, int index);
+
+// Free a batch object and every buffer that was read.
+void fs_batch_destroy(fs_batch_t* batch);
+
 // Queue a file write.
 // File at the specified path will be written in full.
+// Returns immediately, compression included; the buffer must stay valid until the work is done.
 // Returns a work object.
 fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression);
 
+// Queue a file write with a priority other than normal.
+fs_work_t* fs_write_ex(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression, fs_priority_t priority);
+
+// Queue a file save, which replaces the file at the specified path atomically.
+// Writes a temporary file beside it, flushed to disk if flush is set, then renames it over the original.
+// Readers see either the old file or the new one in full, never a partial write.
+// Returns immediately; the buffer must stay valid until the work is done.
+// Returns a work object.
+fs_work_t* fs_save(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression, bool flush);
+
+// Queue a file save with a priority other than normal.
+fs_work_t* fs_save_ex(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression, bool flush, fs_priority_t priority);
+
+// Open a file to append to, creating it if needed. For logs and other growing files.
+// If truncate is true, any existing contents are discarded first.
+// Appends are combined in memory into large writes; only one write is in flight at a time.
+// Memory for the buffers is allocated out of the provided heap.
+// Not safe to use from more than one thread at a time.
+fs_append_t* fs_open_append(fs_t* fs, const char* path, heap_t* heap, bool truncate);
+
+// Append data to a file. The data is copied, so it need not stay valid.
+// Blocks only if the combining buffer fills while the previous write is in flight.
+void fs_append(fs_append_t* append, const void* data, size_t size);
+
+// Queue everything appended so far to be written.
+void fs_append_flush(fs_append_t* append);
+
+// Get the error code for the most recent failed write, blocking for the write in flight.
+// A value of zero generally indicates success.
+int fs_append_get_result(fs_append_t* append);
+
+// Flush, wait for writes to complete, close the file and free its memory.
+void fs_append_close(fs_append_t* append);
+
+// Queue a read-only memory mapping of a file.
+// The buffer is a view of the file shared with the OS page cache; nothing is copied.
+// The buffer must not be written or freed; it is unmapped by fs_work_destroy.
+// Files in the mounted archive can't be mapped directly, so they are read into the fs heap instead.
+// Returns a work object.
+fs_work_t* fs_map(fs_t* fs, const char* path);
+
+// Cancel file work that has not started yet.
+// Returns true if cancelled, in which case the work completes with a nonzero result.
+// Work already started, and streams, run to completion.
+bool fs_work_cancel(fs_work_t* work);
+
 // If true, the file work is complete.
 bool fs_work_is_done(fs_work_t* work);
 
@@ -49,4 +161,22 @@ void* fs_work_get_buffer(fs_work_t* work);
 size_t fs_work_get_size(fs_work_t* work);
 
 // Free a file work object.
+// For reads, also frees the buffer that was read. For maps, unmaps the view.
 void fs_work_destroy(fs_work_t* work);
+
+// Open a file to be read in pieces with bounded memory.
+// The file thread reads (and decompresses) one piece ahead of the caller.
+// Memory for pieces is allocated out of the provided heap and reused.
+fs_stream_t* fs_open_stream(fs_t* fs, const char* path, heap_t* heap, bool use_compression);
+
+// Get the next piece of a stream, blocking until it has been read.
+// Returns NULL at end of file or on error, see fs_stream_get_result.
+// The piece is valid until the next call to fs_stream_read or fs_stream_close.
+const void* fs_stream_read(fs_stream_t* stream, size_t* size);
+
+// Get the error code for a stream.
+// A value of zero generally indicates success.
+int fs_stream_get_result(fs_stream_t* stream);
+
+// Close a stream and free its memory.
+void fs_stream_close(fs_stream_t* stream);
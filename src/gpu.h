@@ -45,9 +45,9 @@ typedef struct gpu_pipeline_info_t
 
 typedef struct gpu_shader_info_t
 {
-	void* vertex_shader_data;
+	const void* vertex_shader_data;
 	size_t vertex_shader_size;
-	void* fragment_shader_data;
+	const void* fragment_shader_data;
 	size_t fragment_shader_size;
 	int uniform_buffer_count;
 } gpu_shader_info_t;
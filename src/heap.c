@@ -1,5 +1,6 @@
 #include "heap.h"
 
+#include "contention.h"
 #include "debug.h"
 #include "mutex.h"
 #include "tlsf/tlsf.h"
@@ -24,6 +25,7 @@ typedef struct heap_t
 	size_t grow_increment;
 	arena_t* arena;
 	mutex_t* mutex;
+	contention_t contention;
 } heap_t;
 
 
@@ -42,6 +44,7 @@ heap_t* heap_create(size_t grow_increment)
 	}
 
 	heap->mutex = mutex_create();
+	contention_init(&heap->contention, "heap");
 	heap->grow_increment = grow_increment;
 	heap->tlsf = tlsf_create(heap + 1);
 	heap->arena = NULL;
@@ -51,7 +54,7 @@ heap_t* heap_create(size_t grow_increment)
 
 void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
 {
-	mutex_lock(heap->mutex);
+	mutex_lock_profiled(heap->mutex, &heap->contention);
 	size = sizeof(void*)*CALLSTACK_S + size;
 
 	void* address = tlsf_memalign(heap->tlsf, alignment, size);
@@ -88,11 +91,16 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
 
 void heap_free(heap_t* heap, void* address)
 {
-	mutex_lock(heap->mutex);
+	mutex_lock_profiled(heap->mutex, &heap->contention);
 	tlsf_free(heap->tlsf, (char*)address- sizeof(void*) * CALLSTACK_S);
 	mutex_unlock(heap->mutex);
 }
 
+const contention_t* heap_get_contention(heap_t* heap)
+{
+	return &heap->contention;
+}
+
 void heap_destroy(heap_t* heap)
 {
 	symbol_init();
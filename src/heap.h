@@ -10,6 +10,8 @@
 // Handle to a heap.
 typedef struct heap_t heap_t;
 
+typedef struct contention_t contention_t;
+
 // Creates a new memory heap.
 // The grow increment is the default size with which the heap grows.
 // Should be a multiple of OS page size.
@@ -23,3 +25,6 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment);
 
 // Free memory previously allocated from a heap.
 void heap_free(heap_t* heap, void* address);
+
+// Get contention statistics for the heap's lock.
+const contention_t* heap_get_contention(heap_t* heap);
@@ -1,7 +1,11 @@
+#include "asset.h"
+#include "contention.h"
 #include "debug.h"
+#include "frame_profiler.h"
 #include "fs.h"
 #include "heap.h"
 #include "render.h"
+#include "sampler.h"
 #include "simple_game.h"
 #include "frogger_game.h"
 #include "timer.h"
@@ -15,17 +19,20 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <windows.h>
 
 static void homework1_test();
 static void homework2_test();
 static void homework3_test();
+static void fs_read_batch_test();
 
 int main(int argc, const char* argv[])
 {
 	debug_set_print_mask(k_print_info | k_print_warning | k_print_error);
 	debug_install_exception_handler();
+	thread_set_name("main");
 
 	
 	// homework1_test();
@@ -37,12 +44,89 @@ int main(int argc, const char* argv[])
 	cpp_test_function(42);
 
 	// homework3_test();
+	// fs_read_batch_test();
 
 
 	heap_t* heap = heap_create(2 * 1024 * 1024);
 	fs_t* fs = fs_create(heap, 8);
+
+	// Offline asset packing: ga2022 --pack <directory> <archive>
+	if (argc >= 4 && strcmp(argv[1], "--pack") == 0)
+	{
+		int result = fs_pack_archive(fs, heap, argv[2], argv[3], true);
+		fs_destroy(fs);
+		heap_destroy(heap);
+		return result;
+	}
+	// Offline trace conversion: ga2022 --convert-trace <trace> <json>
+	if (argc >= 4 && strcmp(argv[1], "--convert-trace") == 0)
+	{
+		int result = trace_convert_to_json(heap, argv[2], argv[3]);
+		fs_destroy(fs);
+		heap_destroy(heap);
+		return result;
+	}
+
+	// Keep console output off the game's threads from here on.
+	// Hot-path info prints, such as per-frame input logging, are capped.
+	debug_print_async_start();
+	debug_set_print_rate_limit(k_print_info, 100);
+
+	// Capture the whole run with: ga2022 --trace <file>
+	// Or keep recent history and write hitch_<n>.json after slow frames: ga2022 --hitch-traces
+	// The trace does one or the other, so --trace wins if both are given.
+	// Add --trace-cycles to either to record CPU cycles per duration.
+	// Sample every thread's call stack and write folded stacks with: ga2022 --profile <file>
+	trace_t* trace = trace_create(heap, 16 * 1024);
+	fs_set_trace(fs, trace);
+	trace_set_fs(trace, fs);
+	frame_profiler_t* profiler = frame_profiler_create(heap, 16667);
+	sampler_t* sampler = NULL;
+	const char* sampler_path = NULL;
+	const char* trace_path = NULL;
+	bool hitch_traces = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+		{
+			trace_path = argv[i + 1];
+		}
+		else if (strcmp(argv[i], "--trace-cycles") == 0)
+		{
+			trace_set_cycle_counting(trace, true);
+		}
+		else if (strcmp(argv[i], "--hitch-traces") == 0)
+		{
+			hitch_traces = true;
+		}
+		else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+		{
+			sampler_path = argv[i + 1];
+			sampler = sampler_create(heap, 1000, 8 * 1024);
+		}
+	}
+	if (trace_path && hitch_traces)
+	{
+		debug_print(k_print_warning, "--hitch-traces ignored, it can't be combined with --trace\n");
+	}
+	if (trace_path)
+	{
+		trace_capture_start(trace, trace_path);
+	}
+	else if (hitch_traces)
+	{
+		trace_flight_recorder_start(trace);
+		frame_profiler_set_hitch_dump(profiler, trace, 50000);
+	}
+
+	// Optional; loose files are used when there is no archive.
+	fs_mount_archive(fs, "assets.gaa");
+	asset_cache_t* assets = asset_cache_create(heap, fs, 16 * 1024 * 1024);
+
 	wm_window_t* window = wm_create(heap);
 	render_t* render = render_create(heap, window);
+	render_set_trace(render, trace);
+	render_set_frame_profiler(render, profiler);
 
 	//int port = 12345;
 	//if (argc >= 2)
@@ -51,12 +135,23 @@ int main(int argc, const char* argv[])
 	//}
 	//net_t* net = net_create(heap, port);
 
-	frogger_game_t* game = frogger_game_create(heap, fs, window, render);
+	frogger_game_t* game = frogger_game_create(heap, assets, window, render);
 
 	while (!wm_pump(window))
 	{
 		//net_update(net);
+		TRACE_INSTANT(trace, "frame");
+		uint64_t game_start = timer_get_ticks();
 		frogger_game_update(game);
+		frame_profiler_add(profiler, k_frame_phase_game, timer_get_ticks() - game_start);
+		frame_profiler_frame_end(profiler);
+	}
+
+	if (sampler)
+	{
+		sampler_stop(sampler);
+		sampler_write_folded(sampler, sampler_path);
+		sampler_destroy(sampler);
 	}
 
 	/* XXX: Shutdown render before the game. Render uses game resources. */
@@ -65,8 +160,17 @@ int main(int argc, const char* argv[])
 	frogger_game_destroy(game);
 
 	wm_destroy(window);
+	asset_cache_destroy(assets);
+	// The trace writes through fs, and fs records into the trace.
+	trace_capture_stop(trace);
+	fs_set_trace(fs, NULL);
+	trace_destroy(trace);
 	fs_destroy(fs);
+	frame_profiler_print(profiler);
+	frame_profiler_destroy(profiler);
+	contention_print(heap_get_contention(heap));
 	heap_destroy(heap);
+	debug_print_async_stop();
 
 	return 0;
 }
@@ -80,17 +184,18 @@ int main(int argc, const char* argv[])
 
 static void homework3_slower_function(trace_t* trace)
 {
-	trace_duration_push(trace, "homework3_slower_function");
-	thread_sleep(200);
-	trace_duration_pop(trace);
+	TRACE_SCOPE(trace, "homework3_slower_function")
+	{
+		thread_sleep(200);
+	}
 }
 
 static void homework3_slow_function(trace_t* trace)
 {
-	trace_duration_push(trace, "homework3_slow_function");
+	TRACE_PUSH(trace, "homework3_slow_function");
 	thread_sleep(100);
 	homework3_slower_function(trace);
-	trace_duration_pop(trace);
+	TRACE_POP(trace);
 }
 
 static int homework3_test_func(void* data)
@@ -122,7 +227,7 @@ static void homework3_test()
 	// (up to event_capacity) before writing to a file. For purposes of this homework,
 	// it is entirely fine if you only capture the first event_capacity count events and
 	// ignore any additional events.
-	trace_capture_start(trace, "trace.json");
+	trace_capture_start(trace, "trace.bin");
 
 	// Create a thread that will push/pop duration events.
 	thread_t* thread = thread_create(homework3_test_func, trace);
@@ -133,8 +238,9 @@ static void homework3_test()
 	// Wait for thread to finish.
 	thread_destroy(thread);
 
-	// Finish capturing. Write the trace.json file in Chrome tracing format.
+	// Finish capturing, then convert to trace.json in Chrome tracing format.
 	trace_capture_stop(trace);
+	trace_convert_to_json(heap, "trace.bin", "trace.json");
 
 	trace_destroy(trace);
 
@@ -205,4 +311,42 @@ static void homework2_test()
 
 	fs_destroy(fs);
 	heap_destroy(heap);
-}
\ No newline at end of file
+}
+
+// A batch several times larger than the file queue must still complete.
+static void fs_read_batch_test()
+{
+	heap_t* heap = heap_create(4096);
+	const int k_queue_capacity = 4;
+	fs_t* fs = fs_create(heap, k_queue_capacity);
+
+	enum { k_file_count = 19 };
+	char names[k_file_count][32];
+	const char* paths[k_file_count];
+	for (int i = 0; i < k_file_count; ++i)
+	{
+		sprintf_s(names[i], sizeof(names[i]), "batch_%d.txt", i);
+		paths[i] = names[i];
+		fs_work_t* write_work = fs_write(fs, paths[i], names[i], strlen(names[i]), false);
+		fs_work_wait(write_work);
+		assert(fs_work_get_result(write_work) == 0);
+		fs_work_destroy(write_work);
+	}
+
+	fs_batch_t* batch = fs_read_batch(fs, paths, k_file_count, heap, true, false);
+	fs_batch_wait(batch);
+	for (int i = 0; i < k_file_count; ++i)
+	{
+		assert(fs_batch_get_result(batch, i) == 0);
+		assert(strcmp(fs_batch_get_buffer(batch, i), names[i]) == 0);
+	}
+	fs_batch_destroy(batch);
+
+	for (int i = 0; i < k_file_count; ++i)
+	{
+		DeleteFileA(paths[i]);
+	}
+
+	fs_destroy(fs);
+	heap_destroy(heap);
+}
@@ -0,0 +1,55 @@
+#include "mpsc_queue.h"
+
+#include "atomic.h"
+#include "heap.h"
+
+typedef struct mpsc_queue_t
+{
+	heap_t* heap;
+	// Most recently pushed item. Items link from newest to oldest.
+	void* head;
+} mpsc_queue_t;
+
+mpsc_queue_t* mpsc_queue_create(heap_t* heap)
+{
+	mpsc_queue_t* queue = heap_alloc(heap, sizeof(mpsc_queue_t), 8);
+	queue->heap = heap;
+	queue->head = NULL;
+	return queue;
+}
+
+void mpsc_queue_destroy(mpsc_queue_t* queue)
+{
+	heap_free(queue->heap, queue);
+}
+
+bool mpsc_queue_push(mpsc_queue_t* queue, mpsc_node_t* node)
+{
+	void* head = atomic_load_ptr(&queue->head, k_atomic_relaxed);
+	do
+	{
+		node->next = head;
+	} while (!atomic_compare_exchange_ptr(&queue->head, &head, node, k_atomic_release));
+	return head == NULL;
+}
+
+mpsc_node_t* mpsc_queue_pop_all(mpsc_queue_t* queue)
+{
+	mpsc_node_t* node = atomic_exchange_ptr(&queue->head, NULL, k_atomic_acquire);
+
+	// Reverse newest-first into push order.
+	mpsc_node_t* oldest = NULL;
+	while (node)
+	{
+		mpsc_node_t* next = node->next;
+		node->next = oldest;
+		oldest = node;
+		node = next;
+	}
+	return oldest;
+}
+
+bool mpsc_queue_is_empty(mpsc_queue_t* queue)
+{
+	return atomic_load_ptr(&queue->head, k_atomic_relaxed) == NULL;
+}
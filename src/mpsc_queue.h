@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Unbounded, lock-free, multi-producer single-consumer queue.
+//
+// The queue is intrusive: each item embeds an mpsc_node_t, so pushing never
+// allocates, never blocks and never drops. The consumer takes everything
+// pushed so far with one atomic exchange.
+
+// Handle to a multi-producer single-consumer queue.
+typedef struct mpsc_queue_t mpsc_queue_t;
+
+typedef struct heap_t heap_t;
+
+// Link embedded in each item pushed onto an mpsc_queue_t.
+typedef struct mpsc_node_t
+{
+	struct mpsc_node_t* next;
+} mpsc_node_t;
+
+// Get the item that embeds a node.
+// For example: packet_t* packet = mpsc_node_owner(node, packet_t, node);
+#define mpsc_node_owner(node, type, member) ((type*)((char*)(node) - offsetof(type, member)))
+
+// Create an empty queue.
+mpsc_queue_t* mpsc_queue_create(heap_t* heap);
+
+// Destroy a previously created queue.
+// Items still in the queue are not freed.
+void mpsc_queue_destroy(mpsc_queue_t* queue);
+
+// Push an item onto a queue.
+// Returns true if the queue was empty, so the caller knows to wake the consumer.
+// Safe for multiple threads to push at the same time.
+bool mpsc_queue_push(mpsc_queue_t* queue, mpsc_node_t* node);
+
+// Pop every item off a queue.
+// Returns the oldest item, linked through next to the newest, or NULL if empty.
+// Only one thread may pop at a time.
+mpsc_node_t* mpsc_queue_pop_all(mpsc_queue_t* queue);
+
+// If true, the queue has no items.
+bool mpsc_queue_is_empty(mpsc_queue_t* queue);
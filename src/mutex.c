@@ -1,5 +1,8 @@
 #include "mutex.h"
 
+#include "contention.h"
+#include "timer.h"
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
@@ -18,6 +21,26 @@ void mutex_lock(mutex_t* mutex)
 	WaitForSingleObject(mutex, INFINITE);
 }
 
+void mutex_lock_profiled(mutex_t* mutex, contention_t* contention)
+{
+	if (!CONTENTION_ENABLED || !contention)
+	{
+		mutex_lock(mutex);
+		return;
+	}
+
+	if (WaitForSingleObject(mutex, 0) == WAIT_OBJECT_0)
+	{
+		contention_record_wait(contention, 0);
+		return;
+	}
+
+	uint64_t start = timer_get_ticks();
+	WaitForSingleObject(mutex, INFINITE);
+	uint64_t wait = timer_get_ticks() - start;
+	contention_record_wait(contention, wait ? wait : 1);
+}
+
 void mutex_unlock(mutex_t* mutex)
 {
 	ReleaseMutex(mutex);
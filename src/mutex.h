@@ -5,6 +5,8 @@
 // Handle to a mutex.
 typedef struct mutex_t mutex_t;
 
+typedef struct contention_t contention_t;
+
 // Creates a new mutex.
 mutex_t* mutex_create();
 
@@ -16,5 +18,9 @@ void mutex_destroy(mutex_t* mutex);
 // multiple times.
 void mutex_lock(mutex_t* mutex);
 
+// Locks a mutex and records how long the caller waited into contention.
+// Behaves like mutex_lock if contention is NULL.
+void mutex_lock_profiled(mutex_t* mutex, contention_t* contention);
+
 // Unlocks a mutex.
 void mutex_unlock(mutex_t* mutex);
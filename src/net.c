@@ -1,7 +1,9 @@
 #include "net.h"
 
+#include "contention.h"
 #include "debug.h"
 #include "heap.h"
+#include "mpsc_queue.h"
 #include "mutex.h"
 #include "queue.h"
 #include "thread.h"
@@ -50,6 +52,7 @@ typedef struct snapshot_t
 
 typedef struct packet_t
 {
+	mpsc_node_t node;
 	int size;
 	char data[k_net_mtu];
 } packet_t;
@@ -78,7 +81,7 @@ typedef struct connection_t
 	thread_t* send_thread;
 
 	queue_t* send_queue;
-	queue_t* recv_queue;
+	mpsc_queue_t* recv_queue;
 
 	uint32_t last_recv_ms;
 
@@ -96,6 +99,7 @@ typedef struct net_t
 	thread_t* recv_thread;
 
 	mutex_t* connections_mutex;
+	contention_t connections_contention;
 	connection_t connections[3];
 
 	entity_type_t entity_types[k_max_entity_types];
@@ -110,6 +114,7 @@ static void timeout_old_connections(net_t* net);
 static void snapshot_entities(net_t* net);
 static void packet_send(connection_t* connection);
 static void packet_recv(connection_t* connection);
+static void packets_free(net_t* net, mpsc_queue_t* queue);
 
 net_t* net_create(heap_t* heap, ecs_t* ecs)
 {
@@ -123,6 +128,7 @@ net_t* net_create(heap_t* heap, ecs_t* ecs)
 
 	net->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	net->connections_mutex = mutex_create();
+	contention_init(&net->connections_contention, "net connections");
 
 	struct sockaddr_in address;
 	address.sin_family = AF_INET;
@@ -134,7 +140,8 @@ net_t* net_create(heap_t* heap, ecs_t* ecs)
 	getsockname(net->sock, (struct sockaddr*)&address, &address_len);
 	debug_print(k_print_info, "Net bound port %d\n", ntohs(address.sin_port));
 
-	net->recv_thread = thread_create(recv_thread_func, net);
+	thread_info_t thread_info = { .name = "net recv", .priority = k_thread_priority_high };
+	net->recv_thread = thread_create_ex(recv_thread_func, net, &thread_info);
 
 	return net;
 }
@@ -149,6 +156,11 @@ void net_destroy(net_t* net)
 	heap_free(net->heap, net);
 }
 
+const contention_t* net_get_contention(net_t* net)
+{
+	return &net->connections_contention;
+}
+
 void net_update(net_t* net)
 {
 	timeout_old_connections(net);
@@ -172,7 +184,7 @@ void net_connect(net_t* net, const net_address_t* address)
 
 void net_disconnect_all(net_t* net)
 {
-	mutex_lock(net->connections_mutex);
+	mutex_lock_profiled(net->connections_mutex, &net->connections_contention);
 
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
@@ -182,7 +194,7 @@ void net_disconnect_all(net_t* net)
 			queue_push(c->send_queue, NULL);
 			thread_destroy(c->send_thread);
 			queue_destroy(c->send_queue);
-			queue_destroy(c->recv_queue);
+			packets_free(net, c->recv_queue);
 		}
 	}
 	memset(net->connections, 0, sizeof(net->connections));
@@ -308,7 +320,7 @@ static connection_t* find_or_create_connection(net_t* net, const net_address_t*
 {
 	connection_t* result = NULL;
 
-	mutex_lock(net->connections_mutex);
+	mutex_lock_profiled(net->connections_mutex, &net->connections_contention);
 
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
@@ -332,8 +344,9 @@ static connection_t* find_or_create_connection(net_t* net, const net_address_t*
 				c->ack_sequence = -1;
 				c->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
 				c->send_queue = queue_create(net->heap, 3);
-				c->recv_queue = queue_create(net->heap, 3);
-				c->send_thread = thread_create(send_thread_func, c);
+				c->recv_queue = mpsc_queue_create(net->heap);
+				thread_info_t thread_info = { .name = "net send" };
+				c->send_thread = thread_create_ex(send_thread_func, c, &thread_info);
 
 				result = c;
 				break;
@@ -383,7 +396,7 @@ static int recv_thread_func(void* user)
 		}
 		connection->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
 
-		queue_try_push(connection->recv_queue, packet);
+		mpsc_queue_push(connection->recv_queue, &packet->node);
 	}
 
 	return 0;
@@ -391,7 +404,7 @@ static int recv_thread_func(void* user)
 
 static void timeout_old_connections(net_t* net)
 {
-	mutex_lock(net->connections_mutex);
+	mutex_lock_profiled(net->connections_mutex, &net->connections_contention);
 
 	uint32_t now = timer_ticks_to_ms(timer_get_ticks());
 	for (int i = 0; i < _countof(net->connections); ++i)
@@ -404,7 +417,7 @@ static void timeout_old_connections(net_t* net)
 			queue_push(c->send_queue, NULL);
 			thread_destroy(c->send_thread);
 			queue_destroy(c->send_queue);
-			queue_destroy(c->recv_queue);
+			packets_free(net, c->recv_queue);
 			memset(c, 0, sizeof(*c));
 		}
 	}
@@ -598,26 +611,34 @@ static void packet_recv(connection_t* connection)
 {
 	net_t* net = connection->net;
 
-	while (true)
+	mpsc_node_t* node = mpsc_queue_pop_all(connection->recv_queue);
+	while (node)
 	{
-		packet_t* packet = queue_try_pop(connection->recv_queue);
-		if (!packet || !packet->size)
-		{
-			break;
-		}
+		packet_t* packet = mpsc_node_owner(node, packet_t, node);
+		node = node->next;
 
 		packet_header_t header;
 		memcpy(&header, packet->data, sizeof(header));
-		if (header.sequence <= connection->incoming_sequence)
+		if (packet->size && header.sequence > connection->incoming_sequence)
 		{
-			continue;
-		}
+			connection->incoming_sequence = header.sequence;
+			connection->ack_sequence = header.ack_sequence;
 
-		connection->incoming_sequence = header.sequence;
-		connection->ack_sequence = header.ack_sequence;
+			packet_read_entities(connection, &packet->data[sizeof(header)], packet->size - sizeof(header));
+		}
 
-		packet_read_entities(connection, &packet->data[sizeof(header)], packet->size - sizeof(header));
+		heap_free(net->heap, packet);
+	}
+}
 
+static void packets_free(net_t* net, mpsc_queue_t* queue)
+{
+	mpsc_node_t* node = mpsc_queue_pop_all(queue);
+	while (node)
+	{
+		packet_t* packet = mpsc_node_owner(node, packet_t, node);
+		node = node->next;
 		heap_free(net->heap, packet);
 	}
+	mpsc_queue_destroy(queue);
 }
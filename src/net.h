@@ -7,6 +7,7 @@
 
 typedef struct net_t net_t;
 
+typedef struct contention_t contention_t;
 typedef struct heap_t heap_t;
 
 typedef struct net_address_t
@@ -29,3 +30,5 @@ void net_state_register_entity_type(net_t* net, int type, uint64_t component_mas
 void net_state_register_entity_instance(net_t* net, int type, ecs_entity_ref_t entity);
 
 bool net_string_to_address(const char* str, net_address_t* address);
+
+const contention_t* net_get_contention(net_t* net);
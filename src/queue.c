@@ -1,63 +1,101 @@
+#include "queue.h"
+
 #include "atomic.h"
+#include "contention.h"
 #include "heap.h"
 #include "semaphore.h"
+#include "timer.h"
+
+#include <limits.h>
+#include <stdio.h>
+
+// Counting semaphore that only enters the kernel when a thread has to sleep.
+// A negative count is the number of sleeping threads.
+// Lets batch operations claim or release many slots with one atomic.
+typedef struct queue_counter_t
+{
+	int32_t count;
+	semaphore_t* wait;
+	contention_t contention;
+} queue_counter_t;
 
 typedef struct queue_t
 {
 	heap_t* heap;
-	semaphore_t* used_items;
-	semaphore_t* free_items;
+	queue_counter_t used_items;
+	queue_counter_t free_items;
 	void** items;
 	int capacity;
 	int head_index;
 	int tail_index;
 } queue_t;
 
+static void counter_init(queue_counter_t* counter, int count);
+static void counter_acquire(queue_counter_t* counter);
+static int counter_try_acquire(queue_counter_t* counter, int max_count);
+static void counter_release(queue_counter_t* counter, int count);
+
 queue_t* queue_create(heap_t* heap, int capacity)
 {
 	queue_t* queue = heap_alloc(heap, sizeof(queue_t), 8);
 	queue->items = heap_alloc(heap, sizeof(void*) * capacity, 8);
-	queue->used_items = semaphore_create(0, capacity);
-	queue->free_items = semaphore_create(capacity, capacity);
+	counter_init(&queue->used_items, 0);
+	counter_init(&queue->free_items, capacity);
 	queue->heap = heap;
 	queue->capacity = capacity;
 	queue->head_index = 0;
 	queue->tail_index = 0;
+	queue_set_name(queue, "queue");
 	return queue;
 }
 
 void queue_destroy(queue_t* queue)
 {
-	semaphore_destroy(queue->used_items);
-	semaphore_destroy(queue->free_items);
+	semaphore_destroy(queue->used_items.wait);
+	semaphore_destroy(queue->free_items.wait);
 	heap_free(queue->heap, queue->items);
 	heap_free(queue->heap, queue);
 }
 
+void queue_set_name(queue_t* queue, const char* name)
+{
+	char buffer[k_contention_name_length];
+	snprintf(buffer, sizeof(buffer), "%s push", name);
+	contention_init(&queue->free_items.contention, buffer);
+	snprintf(buffer, sizeof(buffer), "%s pop", name);
+	contention_init(&queue->used_items.contention, buffer);
+}
+
+const contention_t* queue_get_push_contention(queue_t* queue)
+{
+	return &queue->free_items.contention;
+}
+
+const contention_t* queue_get_pop_contention(queue_t* queue)
+{
+	return &queue->used_items.contention;
+}
+
 void queue_push(queue_t* queue, void* item)
 {
-	semaphore_acquire(queue->free_items);
-	int index = atomic_increment(&queue->tail_index) % queue->capacity;
-	queue->items[index] = item;
-	semaphore_release(queue->used_items);
+	queue_push_many(queue, &item, 1);
 }
 
 void* queue_pop(queue_t* queue)
 {
-	semaphore_acquire(queue->used_items);
-	int index = atomic_increment(&queue->head_index) % queue->capacity;
-	void* item = queue->items[index];
-	semaphore_release(queue->free_items);
+	void* item;
+	queue_pop_many(queue, &item, 1);
 	return item;
 }
 
 bool queue_try_push(queue_t* queue, void* item)
 {
-	if (semaphore_try_acquire(queue->free_items))
+	if (counter_try_acquire(&queue->free_items, 1))
 	{
 		int index = atomic_increment(&queue->tail_index) % queue->capacity;
 		queue->items[index] = item;
-		semaphore_release(queue->used_items);
+		contention_record_depth(&queue->free_items.contention, 1);
+		counter_release(&queue->used_items, 1);
 		return true;
 	}
 	return false;
@@ -65,12 +103,96 @@ bool queue_try_push(queue_t* queue, void* item)
 
 void* queue_try_pop(queue_t* queue)
 {
-	if (semaphore_try_acquire(queue->used_items))
+	if (counter_try_acquire(&queue->used_items, 1))
 	{
 		int index = atomic_increment(&queue->head_index) % queue->capacity;
 		void* item = queue->items[index];
-		semaphore_release(queue->free_items);
+		contention_record_depth(&queue->free_items.contention, -1);
+		counter_release(&queue->free_items, 1);
 		return item;
 	}
 	return NULL;
 }
+
+void queue_push_many(queue_t* queue, void** items, int count)
+{
+	while (count > 0)
+	{
+		counter_acquire(&queue->free_items);
+		int reserved = 1 + counter_try_acquire(&queue->free_items, count - 1);
+
+		int tail = atomic_fetch_add32(&queue->tail_index, reserved, k_atomic_relaxed);
+		for (int i = 0; i < reserved; ++i)
+		{
+			queue->items[(tail + i) % queue->capacity] = items[i];
+		}
+		contention_record_depth(&queue->free_items.contention, reserved);
+		counter_release(&queue->used_items, reserved);
+
+		items += reserved;
+		count -= reserved;
+	}
+}
+
+int queue_pop_many(queue_t* queue, void** items, int max_count)
+{
+	if (max_count <= 0)
+	{
+		return 0;
+	}
+
+	counter_acquire(&queue->used_items);
+	int reserved = 1 + counter_try_acquire(&queue->used_items, max_count - 1);
+
+	int head = atomic_fetch_add32(&queue->head_index, reserved, k_atomic_relaxed);
+	for (int i = 0; i < reserved; ++i)
+	{
+		items[i] = queue->items[(head + i) % queue->capacity];
+	}
+	contention_record_depth(&queue->free_items.contention, -reserved);
+	counter_release(&queue->free_items, reserved);
+	return reserved;
+}
+
+static void counter_init(queue_counter_t* counter, int count)
+{
+	counter->count = count;
+	counter->wait = semaphore_create(0, INT_MAX);
+}
+
+static void counter_acquire(queue_counter_t* counter)
+{
+	if (atomic_fetch_add32(&counter->count, -1, k_atomic_acquire) > 0)
+	{
+		contention_record_wait(&counter->contention, 0);
+		return;
+	}
+
+	uint64_t start = timer_get_ticks();
+	semaphore_acquire(counter->wait);
+	uint64_t wait = timer_get_ticks() - start;
+	contention_record_wait(&counter->contention, wait ? wait : 1);
+}
+
+static int counter_try_acquire(queue_counter_t* counter, int max_count)
+{
+	int32_t count = atomic_load32(&counter->count, k_atomic_relaxed);
+	while (max_count > 0 && count > 0)
+	{
+		int32_t taken = count < max_count ? count : max_count;
+		if (atomic_compare_exchange32(&counter->count, &count, count - taken, k_atomic_acquire))
+		{
+			return taken;
+		}
+	}
+	return 0;
+}
+
+static void counter_release(queue_counter_t* counter, int count)
+{
+	int32_t old_count = atomic_fetch_add32(&counter->count, count, k_atomic_release);
+	if (old_count < 0)
+	{
+		semaphore_release_count(counter->wait, -old_count < count ? -old_count : count);
+	}
+}
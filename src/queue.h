@@ -7,6 +7,7 @@
 // Handle to a thread-safe queue.
 typedef struct queue_t queue_t;
 
+typedef struct contention_t contention_t;
 typedef struct heap_t heap_t;
 
 // Create a queue with the defined capacity.
@@ -15,6 +16,17 @@ queue_t* queue_create(heap_t* heap, int capacity);
 // Destroy a previously created queue.
 void queue_destroy(queue_t* queue);
 
+// Name a queue for its contention statistics.
+// Statistics are reported as "<name> push" and "<name> pop".
+void queue_set_name(queue_t* queue, const char* name);
+
+// Get contention statistics for threads waiting on a full queue.
+// Also tracks the maximum depth the queue reached.
+const contention_t* queue_get_push_contention(queue_t* queue);
+
+// Get contention statistics for threads waiting on an empty queue.
+const contention_t* queue_get_pop_contention(queue_t* queue);
+
 // Push an item onto a queue.
 // If the queue is full, blocks until space is available.
 // Safe for multiple threads to push at the same time.
@@ -34,3 +46,16 @@ bool queue_try_push(queue_t* queue, void* item);
 // If the queue is empty, returns NULL.
 // Safe for multiple threads to pop at the same time.
 void* queue_try_pop(queue_t* queue);
+
+// Push count items onto a queue, in order.
+// Claims as many free slots as are available in one reservation and wakes
+// consumers once per reservation. If the queue is full, blocks until space is available.
+// Safe for multiple threads to push at the same time.
+void queue_push_many(queue_t* queue, void** items, int count);
+
+// Pop up to max_count items off a queue (FIFO order).
+// If the queue is empty, blocks until at least one item is available,
+// then takes everything else available up to max_count.
+// Returns the number of items written to items.
+// Safe for multiple threads to pop at the same time.
+int queue_pop_many(queue_t* queue, void** items, int max_count);
@@ -1,10 +1,15 @@
 #include "render.h"
 
+#include "contention.h"
 #include "ecs.h"
+#include "frame_profiler.h"
 #include "gpu.h"
 #include "heap.h"
 #include "queue.h"
+#include "semaphore.h"
 #include "thread.h"
+#include "timer.h"
+#include "trace.h"
 #include "wm.h"
 
 #include <assert.h>
@@ -13,6 +18,10 @@
 enum
 {
 	k_render_max_drawables = 512,
+	k_render_max_batch = 64,
+	k_render_queue_capacity = 2 * k_render_max_batch,
+	// Frames the game may queue ahead of the render thread before it waits.
+	k_render_max_frames_ahead = 2,
 };
 
 typedef enum command_type_t
@@ -65,6 +74,17 @@ typedef struct render_t
 	thread_t* thread;
 	gpu_t* gpu;
 	queue_t* queue;
+	// Counts frames queued but not yet ended on the GPU, so the game can't run
+	// ahead unbounded now that the queue holds many commands.
+	semaphore_t* frames_ahead;
+	// Optional; records a flow from each pushed model to its draw.
+	trace_t* trace;
+	// Optional; receives render submit and GPU wait times per frame.
+	frame_profiler_t* profiler;
+
+	// Commands pushed by the game thread, waiting to be queued as one batch.
+	void* pending_commands[k_render_max_batch];
+	int pending_count;
 
 	int frame_counter;
 	int gpu_frame_count;
@@ -78,6 +98,8 @@ typedef struct render_t
 } render_t;
 
 static int render_thread_func(void* user);
+static void push_command(render_t* render, void* command);
+static void flush_commands(render_t* render);
 static draw_shader_t* create_or_get_shader_for_model_command(render_t* render, model_command_t* command);
 static draw_mesh_t* create_or_get_mesh_for_model_command(render_t* render, model_command_t* command);
 static draw_instance_t* create_or_get_instance_for_model_command(render_t* render, model_command_t* command, gpu_shader_t* shader);
@@ -88,23 +110,47 @@ render_t* render_create(heap_t* heap, wm_window_t* window)
 	render_t* render = heap_alloc(heap, sizeof(render_t), 8);
 	render->heap = heap;
 	render->window = window;
-	render->queue = queue_create(heap, 3);
+	render->queue = queue_create(heap, k_render_queue_capacity);
+	render->frames_ahead = semaphore_create(k_render_max_frames_ahead, k_render_max_frames_ahead);
+	render->pending_count = 0;
+	render->trace = NULL;
+	render->profiler = NULL;
+	queue_set_name(render->queue, "render");
 	render->frame_counter = 0;
 	render->instance_count = 0;
 	render->mesh_count = 0;
 	render->shader_count = 0;
-	render->thread = thread_create(render_thread_func, render);
+	thread_info_t thread_info =
+	{
+		.name = "render",
+		.affinity_mask = thread_get_dedicated_core_mask(0),
+		.priority = k_thread_priority_high,
+	};
+	render->thread = thread_create_ex(render_thread_func, render, &thread_info);
 	return render;
 }
 
 void render_destroy(render_t* render)
 {
+	flush_commands(render);
 	queue_push(render->queue, NULL);
 	thread_destroy(render->thread);
+	contention_print(queue_get_push_contention(render->queue));
 	queue_destroy(render->queue);
+	semaphore_destroy(render->frames_ahead);
 	heap_free(render->heap, render);
 }
 
+void render_set_trace(render_t* render, trace_t* trace)
+{
+	render->trace = trace;
+}
+
+void render_set_frame_profiler(render_t* render, frame_profiler_t* profiler)
+{
+	render->profiler = profiler;
+}
+
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform)
 {
 	model_command_t* command = heap_alloc(render->heap, sizeof(model_command_t), 8);
@@ -115,14 +161,35 @@ void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info
 	command->uniform_buffer.size = uniform->size;
 	command->uniform_buffer.data = heap_alloc(render->heap, uniform->size, 8);
 	memcpy(command->uniform_buffer.data, uniform->data, uniform->size);
-	queue_push(render->queue, command);
+	TRACE_SCOPE(render->trace, "render_push_model")
+	{
+		TRACE_FLOW_BEGIN(render->trace, "render model", (uint64_t)(uintptr_t)command);
+		push_command(render, command);
+	}
 }
 
 void render_push_done(render_t* render)
 {
 	frame_done_command_t* command = heap_alloc(render->heap, sizeof(frame_done_command_t), 8);
 	command->type = k_command_frame_done;
-	queue_push(render->queue, command);
+	push_command(render, command);
+	flush_commands(render);
+	semaphore_acquire(render->frames_ahead);
+}
+
+static void push_command(render_t* render, void* command)
+{
+	render->pending_commands[render->pending_count++] = command;
+	if (render->pending_count == k_render_max_batch)
+	{
+		flush_commands(render);
+	}
+}
+
+static void flush_commands(render_t* render)
+{
+	queue_push_many(render->queue, render->pending_commands, render->pending_count);
+	render->pending_count = 0;
 }
 
 static int render_thread_func(void* user)
@@ -137,13 +204,28 @@ static int render_thread_func(void* user)
 	gpu_mesh_t* last_mesh = NULL;
 	int frame_index = 0;
 
+	void* commands[k_render_max_batch];
+	int command_count = 0;
+	int command_index = 0;
+
+	// Time spent processing this frame's commands, not waiting for them.
+	uint64_t submit_ticks = 0;
+
 	while (true)
 	{
-		command_type_t* type = queue_pop(render->queue);
+		if (command_index == command_count)
+		{
+			command_count = queue_pop_many(render->queue, commands, k_render_max_batch);
+			command_index = 0;
+			TRACE_COUNTER(render->trace, "render queue depth", queue_get_push_contention(render->queue)->depth);
+		}
+
+		command_type_t* type = commands[command_index++];
 		if (!type)
 		{
 			break;
 		}
+		uint64_t command_start = timer_get_ticks();
 
 		if (!cmdbuf)
 		{
@@ -152,7 +234,16 @@ static int render_thread_func(void* user)
 
 		if (*type == k_command_frame_done)
 		{
+			TRACE_INSTANT(render->trace, "render frame end");
+			uint64_t wait_start = timer_get_ticks();
 			gpu_frame_end(render->gpu);
+			if (render->profiler)
+			{
+				frame_profiler_add(render->profiler, k_frame_phase_gpu_wait, timer_get_ticks() - wait_start);
+				frame_profiler_add(render->profiler, k_frame_phase_render_submit, submit_ticks + (wait_start - command_start));
+			}
+			semaphore_release(render->frames_ahead);
+			submit_ticks = 0;
 			cmdbuf = NULL;
 			last_pipeline = NULL;
 			last_mesh = NULL;
@@ -164,6 +255,8 @@ static int render_thread_func(void* user)
 		else if (*type == k_command_model)
 		{
 			model_command_t* command = (model_command_t*)type;
+			TRACE_PUSH(render->trace, "render draw");
+			TRACE_FLOW_END(render->trace, "render model", (uint64_t)(uintptr_t)command);
 			draw_shader_t* shader = create_or_get_shader_for_model_command(render, command);
 			draw_mesh_t* mesh = create_or_get_mesh_for_model_command(render, command);
 			draw_instance_t* instance = create_or_get_instance_for_model_command(render, command, shader->shader);
@@ -182,6 +275,8 @@ static int render_thread_func(void* user)
 			}
 			gpu_cmd_descriptor_bind(render->gpu, cmdbuf, instance->descriptors[frame_index]);
 			gpu_cmd_draw(render->gpu, cmdbuf);
+			TRACE_POP(render->trace);
+			submit_ticks += timer_get_ticks() - command_start;
 		}
 
 		heap_free(render->heap, type);
@@ -5,10 +5,12 @@
 typedef struct render_t render_t;
 
 typedef struct ecs_entity_ref_t ecs_entity_ref_t;
+typedef struct frame_profiler_t frame_profiler_t;
 typedef struct gpu_mesh_info_t gpu_mesh_info_t;
 typedef struct gpu_shader_info_t gpu_shader_info_t;
 typedef struct gpu_uniform_buffer_info_t gpu_uniform_buffer_info_t;
 typedef struct heap_t heap_t;
+typedef struct trace_t trace_t;
 typedef struct wm_window_t wm_window_t;
 
 // Create a render system.
@@ -17,8 +19,16 @@ render_t* render_create(heap_t* heap, wm_window_t* window);
 // Destroy a render system.
 void render_destroy(render_t* render);
 
+// Record rendering in a trace: a flow from each pushed model to its draw on the
+// render thread, the render queue's depth, and frame ends.
+void render_set_trace(render_t* render, trace_t* trace);
+
+// Report each frame's render submit and GPU wait times to a frame profiler.
+void render_set_frame_profiler(render_t* render, frame_profiler_t* profiler);
+
 // Push a model onto a queue of items to be rendered.
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform);
 
 // Push an end-of-frame marker on a queue of items to be rendered.
+// Blocks while the game is too many frames ahead of the GPU.
 void render_push_done(render_t* render);
@@ -0,0 +1,502 @@
+#include "sampler.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+#include "thread.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <timeapi.h>
+#include <tlhelp32.h>
+
+enum
+{
+	// Frames kept per sample; deeper stacks lose their outermost frames.
+	k_sampler_max_depth = 48,
+	// Threads tracked at once. Slots of exited threads are reused.
+	k_sampler_max_threads = 128,
+	// Most of a thread's stack copied per sample; frames beyond it are lost.
+	k_sampler_stack_copy_size = 1024 * 1024,
+	// Zeroed space after the copy, so unwinding a frame the copy cut short reads
+	// zeros and stops instead of whatever follows the buffer.
+	k_sampler_stack_copy_slack = 16 * 1024,
+	// How many times a second the thread list is refreshed.
+	k_sampler_refresh_rate_hz = 10,
+	// Longest symbol name written, and longest folded line.
+	k_sampler_name_size = 128,
+	k_sampler_line_size = k_sampler_max_depth * k_sampler_name_size,
+};
+
+typedef struct sampler_thread_t
+{
+	DWORD id;
+	HANDLE handle;
+	bool alive;
+	// Distinct stacks recorded against this slot; it's only reused once zero,
+	// unless the new thread has the same name.
+	int stack_count;
+	char name[64];
+} sampler_thread_t;
+
+// A distinct call stack on one thread and how many times it was sampled.
+// frames[0] is the innermost frame.
+typedef struct sampler_stack_t
+{
+	uint64_t hash;
+	int64_t count;
+	uint16_t thread_index;
+	uint16_t depth;
+	void* frames[k_sampler_max_depth];
+} sampler_stack_t;
+
+typedef struct sampler_t
+{
+	heap_t* heap;
+	uint32_t interval_ms;
+	uint32_t refresh_samples;
+	thread_t* thread;
+	int32_t stop;
+
+	// Only the sampler thread writes below here, and only after resuming the
+	// sampled thread. Readers wait for sampler_stop, which joins it.
+	sampler_thread_t threads[k_sampler_max_threads];
+	int thread_count;
+	bool threads_full;
+
+	// The sampled thread's stack, copied while it is suspended.
+	uint8_t* stack_copy;
+
+	// Open-addressed table of distinct stacks, keyed by hash.
+	sampler_stack_t* stacks;
+	uint32_t stack_mask;
+	int stack_capacity;
+	int stack_count;
+	int64_t sample_count;
+	int64_t dropped_count;
+} sampler_t;
+
+static int sampler_thread_func(void* user);
+static void refresh_threads(sampler_t* sampler, DWORD self);
+static int claim_thread_slot(sampler_t* sampler, const char* name);
+static void sample_thread(sampler_t* sampler, int index);
+static size_t copy_stack(const CONTEXT* context, uint8_t* copy, uintptr_t* bottom);
+static int walk_stack(CONTEXT* context, uintptr_t bottom, uint8_t* copy, size_t size, void** frames, int capacity);
+static void record_stack(sampler_t* sampler, int thread_index, void** frames, int depth);
+
+sampler_t* sampler_create(heap_t* heap, uint32_t sample_hz, int stack_capacity)
+{
+	sampler_t* sampler = heap_alloc(heap, sizeof(sampler_t), 8);
+	memset(sampler, 0, sizeof(*sampler));
+	sampler->heap = heap;
+	sampler->interval_ms = sample_hz < 1000 ? 1000 / (sample_hz ? sample_hz : 1) : 1;
+	sampler->refresh_samples = 1000 / k_sampler_refresh_rate_hz / sampler->interval_ms;
+	sampler->refresh_samples = sampler->refresh_samples ? sampler->refresh_samples : 1;
+
+	// Keep the table at most half full so probes stay short.
+	uint32_t table_size = 1;
+	while (table_size < (uint32_t)stack_capacity * 2)
+	{
+		table_size *= 2;
+	}
+	sampler->stack_mask = table_size - 1;
+	sampler->stack_capacity = stack_capacity;
+	sampler->stacks = heap_alloc(heap, sizeof(sampler_stack_t) * table_size, 8);
+	memset(sampler->stacks, 0, sizeof(sampler_stack_t) * table_size);
+	sampler->stack_copy = heap_alloc(heap, k_sampler_stack_copy_size + k_sampler_stack_copy_slack, 16);
+
+	sampler->thread = thread_create_ex(sampler_thread_func, sampler, &(thread_info_t)
+	{
+		.name = "sampler",
+		.priority = k_thread_priority_critical,
+	});
+	return sampler;
+}
+
+void sampler_destroy(sampler_t* sampler)
+{
+	sampler_stop(sampler);
+	for (int i = 0; i < sampler->thread_count; ++i)
+	{
+		if (sampler->threads[i].handle)
+		{
+			CloseHandle(sampler->threads[i].handle);
+		}
+	}
+	heap_free(sampler->heap, sampler->stack_copy);
+	heap_free(sampler->heap, sampler->stacks);
+	heap_free(sampler->heap, sampler);
+}
+
+void sampler_stop(sampler_t* sampler)
+{
+	if (sampler->thread)
+	{
+		atomic_store32(&sampler->stop, 1, k_atomic_release);
+		thread_destroy(sampler->thread);
+		sampler->thread = NULL;
+	}
+}
+
+int sampler_write_folded(sampler_t* sampler, const char* path)
+{
+	fs_t* fs = fs_create(sampler->heap, 4);
+	fs_append_t* out = fs_open_append(fs, path, sampler->heap, true);
+	char* line = heap_alloc(sampler->heap, k_sampler_line_size, 8);
+
+	symbol_init();
+	for (uint32_t i = 0; i <= sampler->stack_mask; ++i)
+	{
+		const sampler_stack_t* stack = &sampler->stacks[i];
+		if (!stack->count)
+		{
+			continue;
+		}
+
+		// Folded stacks list the outermost frame first, after the thread.
+		const sampler_thread_t* thread = &sampler->threads[stack->thread_index];
+		size_t length = snprintf(line, k_sampler_line_size, "%s", thread->name);
+		for (int f = stack->depth - 1; f >= 0 && length < (size_t)k_sampler_line_size; --f)
+		{
+			char name[k_sampler_name_size];
+			if (!symbol_get_name(stack->frames[f], name, sizeof(name)))
+			{
+				snprintf(name, sizeof(name), "0x%p", stack->frames[f]);
+			}
+			length += snprintf(line + length, k_sampler_line_size - length, ";%s", name);
+		}
+		length = __min(length, (size_t)k_sampler_line_size - 1);
+		fs_append(out, line, length);
+
+		length = snprintf(line, k_sampler_line_size, " %lld\n", stack->count);
+		fs_append(out, line, length);
+	}
+	symbol_clean();
+
+	if (sampler->dropped_count)
+	{
+		debug_print(k_print_warning, "Sampler dropped %lld of %lld samples, all %d stack slots in use\n",
+			sampler->dropped_count, sampler->sample_count, sampler->stack_capacity);
+	}
+
+	int result = fs_append_get_result(out);
+	if (result)
+	{
+		debug_print(k_print_error, "Sampler failed to write %s: %d\n", path, result);
+	}
+	fs_append_close(out);
+	heap_free(sampler->heap, line);
+	fs_destroy(fs);
+	return result;
+}
+
+static int sampler_thread_func(void* user)
+{
+	sampler_t* sampler = user;
+	DWORD self = GetCurrentThreadId();
+
+	// Sleep in 1 ms steps rather than the default scheduler tick.
+	timeBeginPeriod(1);
+	for (uint32_t sample = 0; !atomic_load32(&sampler->stop, k_atomic_acquire); ++sample)
+	{
+		if (sample % sampler->refresh_samples == 0)
+		{
+			refresh_threads(sampler, self);
+		}
+		for (int i = 0; i < sampler->thread_count; ++i)
+		{
+			if (sampler->threads[i].alive)
+			{
+				sample_thread(sampler, i);
+			}
+		}
+		thread_sleep(sampler->interval_ms);
+	}
+	timeEndPeriod(1);
+	return 0;
+}
+
+// Pick up threads started since the last refresh and let go of ones that have exited.
+static void refresh_threads(sampler_t* sampler, DWORD self)
+{
+	HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+	if (snapshot == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+
+	for (int i = 0; i < sampler->thread_count; ++i)
+	{
+		sampler->threads[i].alive = false;
+	}
+
+	DWORD pid = GetCurrentProcessId();
+	THREADENTRY32 entry = { .dwSize = sizeof(entry) };
+	for (BOOL more = Thread32First(snapshot, &entry); more; more = Thread32Next(snapshot, &entry))
+	{
+		if (entry.th32OwnerProcessID != pid || entry.th32ThreadID == self)
+		{
+			continue;
+		}
+
+		// Ids of exited threads can be reused, so only match threads still open.
+		int index = 0;
+		while (index < sampler->thread_count &&
+			(sampler->threads[index].id != entry.th32ThreadID || !sampler->threads[index].handle))
+		{
+			++index;
+		}
+		if (index == sampler->thread_count)
+		{
+			HANDLE handle = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_LIMITED_INFORMATION, FALSE, entry.th32ThreadID);
+			if (!handle)
+			{
+				continue;
+			}
+
+			char name[64];
+			snprintf(name, sizeof(name), "thread %lu", entry.th32ThreadID);
+			wchar_t* description = NULL;
+			if (SUCCEEDED(GetThreadDescription(handle, &description)) && description && description[0])
+			{
+				WideCharToMultiByte(CP_UTF8, 0, description, -1, name, (int)sizeof(name), NULL, NULL);
+			}
+			LocalFree(description);
+
+			index = claim_thread_slot(sampler, name);
+			if (index < 0)
+			{
+				if (!sampler->threads_full)
+				{
+					debug_print(k_print_warning, "Sampler is tracking %d threads; new threads will not be sampled\n", k_sampler_max_threads);
+					sampler->threads_full = true;
+				}
+				CloseHandle(handle);
+				continue;
+			}
+
+			sampler_thread_t* thread = &sampler->threads[index];
+			thread->id = entry.th32ThreadID;
+			thread->handle = handle;
+			strcpy_s(thread->name, sizeof(thread->name), name);
+		}
+		sampler->threads[index].alive = true;
+	}
+	CloseHandle(snapshot);
+
+	// Keep exited threads' names for the output, but not their handles.
+	for (int i = 0; i < sampler->thread_count; ++i)
+	{
+		if (!sampler->threads[i].alive && sampler->threads[i].handle)
+		{
+			CloseHandle(sampler->threads[i].handle);
+			sampler->threads[i].handle = NULL;
+		}
+	}
+}
+
+// Find a slot for a new thread, preferring one an exited thread left behind.
+// An exited thread with the same name is reused so its stacks merge with the
+// new thread's; otherwise only a slot with no stacks recorded against it is.
+// Returns -1 if every slot is taken.
+static int claim_thread_slot(sampler_t* sampler, const char* name)
+{
+	int free_index = -1;
+	for (int i = 0; i < sampler->thread_count; ++i)
+	{
+		const sampler_thread_t* thread = &sampler->threads[i];
+		if (thread->handle)
+		{
+			continue;
+		}
+		if (strcmp(thread->name, name) == 0)
+		{
+			return i;
+		}
+		if (free_index < 0 && !thread->stack_count)
+		{
+			free_index = i;
+		}
+	}
+	if (free_index < 0 && sampler->thread_count < k_sampler_max_threads)
+	{
+		free_index = sampler->thread_count++;
+	}
+	return free_index;
+}
+
+static void sample_thread(sampler_t* sampler, int index)
+{
+	sampler_thread_t* thread = &sampler->threads[index];
+	if (SuspendThread(thread->handle) == (DWORD)-1)
+	{
+		return;
+	}
+
+	// While the thread is suspended nothing here may take a lock it could be
+	// holding: no allocation, no printing, no symbol lookups and no unwinding,
+	// since the unwinder's function table lookups can lock. Only copy its
+	// registers and stack; the copy is walked once the thread is running again.
+	CONTEXT context;
+	memset(&context, 0, sizeof(context));
+	context.ContextFlags = CONTEXT_FULL;
+	bool have_context = GetThreadContext(thread->handle, &context) != 0;
+	uintptr_t stack_bottom = 0;
+	size_t stack_size = have_context ? copy_stack(&context, sampler->stack_copy, &stack_bottom) : 0;
+	ResumeThread(thread->handle);
+
+	if (!have_context)
+	{
+		return;
+	}
+	memset(sampler->stack_copy + stack_size, 0, k_sampler_stack_copy_slack);
+	void* frames[k_sampler_max_depth];
+	int depth = walk_stack(&context, stack_bottom, sampler->stack_copy, stack_size, frames, k_sampler_max_depth);
+	if (depth)
+	{
+		record_stack(sampler, index, frames, depth);
+	}
+}
+
+// Copy the used part of a suspended thread's stack, from its stack pointer up
+// to its base or as much as fits. Sets bottom to the address copied from.
+// Returns the number of bytes copied.
+static size_t copy_stack(const CONTEXT* context, uint8_t* copy, uintptr_t* bottom)
+{
+#if defined(_M_X64)
+	// The committed part of a stack is one region, ending at the stack's base.
+	*bottom = (uintptr_t)context->Rsp & ~(uintptr_t)(sizeof(DWORD64) - 1);
+	MEMORY_BASIC_INFORMATION region;
+	if (!VirtualQuery((void*)*bottom, &region, sizeof(region)) || region.State != MEM_COMMIT)
+	{
+		return 0;
+	}
+	uintptr_t top = (uintptr_t)region.BaseAddress + region.RegionSize;
+	size_t size = __min((size_t)(top - *bottom), (size_t)k_sampler_stack_copy_size);
+	memcpy(copy, (void*)*bottom, size);
+	return size;
+#else
+	*bottom = 0;
+	return 0;
+#endif
+}
+
+#if defined(_M_X64)
+static void rebase_stack_pointer(DWORD64* value, uintptr_t bottom, uintptr_t top, uint8_t* copy)
+{
+	if (*value >= bottom && *value < top)
+	{
+		*value = (DWORD64)(uintptr_t)copy + (*value - bottom);
+	}
+}
+#endif
+
+// Unwind a copy of a thread's stack with the image's unwind tables, as the
+// debugger would. Stops at the first frame without unwind data past the
+// innermost one, rather than guessing at a return address, and at the end
+// of the copy.
+static int walk_stack(CONTEXT* context, uintptr_t bottom, uint8_t* copy, size_t size, void** frames, int capacity)
+{
+	int depth = 0;
+#if defined(_M_X64)
+	// Point registers and saved values that referred to the original stack at
+	// the copy, so the unwinder reads the snapshot instead of the live stack.
+	uintptr_t top = bottom + size;
+	DWORD64* registers[] =
+	{
+		&context->Rax, &context->Rcx, &context->Rdx, &context->Rbx,
+		&context->Rsp, &context->Rbp, &context->Rsi, &context->Rdi,
+		&context->R8, &context->R9, &context->R10, &context->R11,
+		&context->R12, &context->R13, &context->R14, &context->R15,
+	};
+	for (int i = 0; i < (int)_countof(registers); ++i)
+	{
+		rebase_stack_pointer(registers[i], bottom, top, copy);
+	}
+	for (size_t offset = 0; offset + sizeof(DWORD64) <= size; offset += sizeof(DWORD64))
+	{
+		rebase_stack_pointer((DWORD64*)(copy + offset), bottom, top, copy);
+	}
+
+	uintptr_t copy_end = (uintptr_t)copy + size;
+	while (depth < capacity && context->Rip)
+	{
+		frames[depth++] = (void*)context->Rip;
+		if (context->Rsp < (uintptr_t)copy || context->Rsp + sizeof(DWORD64) > copy_end)
+		{
+			break;
+		}
+
+		DWORD64 image_base = 0;
+		RUNTIME_FUNCTION* function = RtlLookupFunctionEntry(context->Rip, &image_base, NULL);
+		if (!function)
+		{
+			if (depth > 1)
+			{
+				break;
+			}
+			// A leaf function has no unwind data; its return address is on top of the stack.
+			context->Rip = *(DWORD64*)context->Rsp;
+			context->Rsp += sizeof(DWORD64);
+			continue;
+		}
+
+		void* handler_data = NULL;
+		DWORD64 establisher_frame = 0;
+		RtlVirtualUnwind(UNW_FLAG_NHANDLER, image_base, context->Rip, function, context, &handler_data, &establisher_frame, NULL);
+	}
+#else
+	// No table-based unwinding on 32-bit x86; record where the thread was.
+	if (capacity > 0)
+	{
+		frames[depth++] = (void*)context->Eip;
+	}
+#endif
+	return depth;
+}
+
+static void record_stack(sampler_t* sampler, int thread_index, void** frames, int depth)
+{
+	++sampler->sample_count;
+
+	// FNV-1a over the thread and frame addresses.
+	uint64_t hash = 14695981039346656037ULL;
+	hash = (hash ^ (uint64_t)thread_index) * 1099511628211ULL;
+	for (int i = 0; i < depth; ++i)
+	{
+		hash = (hash ^ (uint64_t)(uintptr_t)frames[i]) * 1099511628211ULL;
+	}
+
+	for (uint32_t slot = (uint32_t)hash & sampler->stack_mask;; slot = (slot + 1) & sampler->stack_mask)
+	{
+		sampler_stack_t* stack = &sampler->stacks[slot];
+		if (!stack->count)
+		{
+			if (sampler->stack_count >= sampler->stack_capacity)
+			{
+				++sampler->dropped_count;
+				return;
+			}
+			++sampler->stack_count;
+			++sampler->threads[thread_index].stack_count;
+			stack->hash = hash;
+			stack->count = 1;
+			stack->thread_index = (uint16_t)thread_index;
+			stack->depth = (uint16_t)depth;
+			memcpy(stack->frames, frames, sizeof(void*) * depth);
+			return;
+		}
+		if (stack->hash == hash &&
+			stack->thread_index == thread_index &&
+			stack->depth == depth &&
+			memcmp(stack->frames, frames, sizeof(void*) * depth) == 0)
+		{
+			++stack->count;
+			return;
+		}
+	}
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+// Sampling CPU profiler.
+//
+// A background thread periodically suspends every other thread in the process,
+// copies its registers and stack, resumes it and then walks the copy. Identical stacks are counted together,
+// so a whole session can be profiled in fixed memory and without adding any
+// instrumentation. Results are written in the folded stack format read by
+// flamegraph.pl, speedscope and similar tools.
+
+// Handle to a sampler.
+typedef struct sampler_t sampler_t;
+
+typedef struct heap_t heap_t;
+
+// Create a sampler and start sampling all threads sample_hz times per second.
+// Up to stack_capacity distinct call stacks are kept; samples of new stacks
+// beyond that are counted as dropped.
+sampler_t* sampler_create(heap_t* heap, uint32_t sample_hz, int stack_capacity);
+
+// Stop sampling and destroy the sampler.
+void sampler_destroy(sampler_t* sampler);
+
+// Stop sampling. Call before writing results.
+void sampler_stop(sampler_t* sampler);
+
+// Write the counted stacks to path, one "thread;outer;...;inner count" line per stack.
+// Symbolizes addresses with the debug module. Sampling must be stopped.
+// Returns zero on success.
+int sampler_write_folded(sampler_t* sampler, const char* path);
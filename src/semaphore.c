@@ -29,3 +29,8 @@ void semaphore_release(semaphore_t* semaphore)
 {
 	ReleaseSemaphore(semaphore, 1, NULL);
 }
+
+void semaphore_release_count(semaphore_t* semaphore, int count)
+{
+	ReleaseSemaphore(semaphore, count, NULL);
+}
@@ -23,3 +23,6 @@ bool semaphore_try_acquire(semaphore_t* semaphore);
 
 // Raises the semaphore count by one.
 void semaphore_release(semaphore_t* semaphore);
+
+// Raises the semaphore count by count in a single operation.
+void semaphore_release_count(semaphore_t* semaphore, int count);
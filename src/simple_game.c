@@ -1,8 +1,8 @@
 #include "simple_game.h"
 
+#include "asset.h"
 #include "debug.h"
 #include "ecs.h"
-#include "fs.h"
 #include "gpu.h"
 #include "heap.h"
 #include "net.h"
@@ -45,7 +45,7 @@ typedef struct name_component_t
 typedef struct simple_game_t
 {
 	heap_t* heap;
-	fs_t* fs;
+	asset_cache_t* assets;
 	wm_window_t* window;
 	render_t* render;
 	net_t* net;
@@ -63,8 +63,8 @@ typedef struct simple_game_t
 
 	gpu_mesh_info_t cube_mesh;
 	gpu_shader_info_t cube_shader;
-	fs_work_t* vertex_shader_work;
-	fs_work_t* fragment_shader_work;
+	asset_t* vertex_shader;
+	asset_t* fragment_shader;
 } simple_game_t;
 
 static void load_resources(simple_game_t* game);
@@ -74,11 +74,11 @@ static void spawn_camera(simple_game_t* game);
 static void update_players(simple_game_t* game);
 static void draw_models(simple_game_t* game);
 
-simple_game_t* simple_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* render, int argc, const char** argv)
+simple_game_t* simple_game_create(heap_t* heap, asset_cache_t* assets, wm_window_t* window, render_t* render, int argc, const char** argv)
 {
 	simple_game_t* game = heap_alloc(heap, sizeof(simple_game_t), 8);
 	game->heap = heap;
-	game->fs = fs;
+	game->assets = assets;
 	game->window = window;
 	game->render = render;
 
@@ -133,14 +133,14 @@ void simple_game_update(simple_game_t* game)
 
 static void load_resources(simple_game_t* game)
 {
-	game->vertex_shader_work = fs_read(game->fs, "shaders/triangle.vert.spv", game->heap, false, false);
-	game->fragment_shader_work = fs_read(game->fs, "shaders/triangle.frag.spv", game->heap, false, false);
+	game->vertex_shader = asset_acquire_mapped(game->assets, "shaders/triangle.vert.spv");
+	game->fragment_shader = asset_acquire_mapped(game->assets, "shaders/triangle.frag.spv");
 	game->cube_shader = (gpu_shader_info_t)
 	{
-		.vertex_shader_data = fs_work_get_buffer(game->vertex_shader_work),
-		.vertex_shader_size = fs_work_get_size(game->vertex_shader_work),
-		.fragment_shader_data = fs_work_get_buffer(game->fragment_shader_work),
-		.fragment_shader_size = fs_work_get_size(game->fragment_shader_work),
+		.vertex_shader_data = asset_get_data(game->vertex_shader),
+		.vertex_shader_size = asset_get_size(game->vertex_shader),
+		.fragment_shader_data = asset_get_data(game->fragment_shader),
+		.fragment_shader_size = asset_get_size(game->fragment_shader),
 		.uniform_buffer_count = 1,
 	};
 
@@ -182,10 +182,8 @@ static void load_resources(simple_game_t* game)
 
 static void unload_resources(simple_game_t* game)
 {
-	heap_free(game->heap, fs_work_get_buffer(game->vertex_shader_work));
-	heap_free(game->heap, fs_work_get_buffer(game->fragment_shader_work));
-	fs_work_destroy(game->fragment_shader_work);
-	fs_work_destroy(game->vertex_shader_work);
+	asset_release(game->fragment_shader);
+	asset_release(game->vertex_shader);
 }
 
 static void player_net_configure(ecs_t* ecs, ecs_entity_ref_t entity, int type, void* user)
@@ -5,6 +5,8 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+static void set_thread_name(HANDLE h, const char* name);
+
 thread_t* thread_create(int (*function)(void*), void* data)
 {
 	HANDLE h = CreateThread(NULL, 0, function, data, CREATE_SUSPENDED, NULL);
@@ -17,6 +19,49 @@ thread_t* thread_create(int (*function)(void*), void* data)
 	return (thread_t*)h;
 }
 
+thread_t* thread_create_ex(int (*function)(void*), void* data, const thread_info_t* info)
+{
+	DWORD flags = CREATE_SUSPENDED;
+	if (info->stack_size)
+	{
+		flags |= STACK_SIZE_PARAM_IS_A_RESERVATION;
+	}
+
+	HANDLE h = CreateThread(NULL, info->stack_size, function, data, flags, NULL);
+	if (h == INVALID_HANDLE_VALUE || h == 0)
+	{
+		debug_print(k_print_warning, "Thread %s failed to create!\n", info->name ? info->name : "");
+		return NULL;
+	}
+
+	if (info->name)
+	{
+		set_thread_name(h, info->name);
+	}
+
+	if (info->affinity_mask && !SetThreadAffinityMask(h, (DWORD_PTR)info->affinity_mask))
+	{
+		debug_print(k_print_warning, "Thread %s failed to set affinity!\n", info->name ? info->name : "");
+	}
+
+	static const int k_priorities[] =
+	{
+		THREAD_PRIORITY_NORMAL,
+		THREAD_PRIORITY_LOWEST,
+		THREAD_PRIORITY_BELOW_NORMAL,
+		THREAD_PRIORITY_NORMAL,
+		THREAD_PRIORITY_ABOVE_NORMAL,
+		THREAD_PRIORITY_TIME_CRITICAL,
+	};
+	if (info->priority != k_thread_priority_default && info->priority != k_thread_priority_normal)
+	{
+		SetThreadPriority(h, k_priorities[info->priority]);
+	}
+
+	ResumeThread(h);
+	return (thread_t*)h;
+}
+
 int thread_destroy(thread_t* thread)
 {
 	WaitForSingleObject(thread, INFINITE);
@@ -30,3 +75,70 @@ void thread_sleep(uint32_t ms)
 {
 	Sleep(ms);
 }
+
+void thread_set_name(const char* name)
+{
+	set_thread_name(GetCurrentThread(), name);
+}
+
+void thread_get_topology(thread_topology_t* topology)
+{
+	topology->physical_core_count = 0;
+	topology->logical_core_count = 0;
+
+	char buffer[16 * 1024];
+	DWORD size = sizeof(buffer);
+	if (!GetLogicalProcessorInformationEx(RelationProcessorCore, (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)buffer, &size))
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		topology->logical_core_count = info.dwNumberOfProcessors < k_thread_max_cores ? (int)info.dwNumberOfProcessors : k_thread_max_cores;
+		topology->physical_core_count = topology->logical_core_count;
+		for (int i = 0; i < topology->physical_core_count; ++i)
+		{
+			topology->core_affinity_masks[i] = 1ULL << i;
+		}
+		return;
+	}
+
+	for (DWORD offset = 0; offset < size;)
+	{
+		SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buffer + offset);
+		offset += info->Size;
+
+		// Only the first processor group fits in a 64-bit affinity mask.
+		if (info->Processor.GroupMask[0].Group != 0 || topology->physical_core_count >= k_thread_max_cores)
+		{
+			continue;
+		}
+
+		uint64_t mask = info->Processor.GroupMask[0].Mask;
+		topology->core_affinity_masks[topology->physical_core_count++] = mask;
+		for (; mask; mask &= mask - 1)
+		{
+			topology->logical_core_count++;
+		}
+	}
+}
+
+uint64_t thread_get_dedicated_core_mask(int index)
+{
+	thread_topology_t topology;
+	thread_get_topology(&topology);
+
+	// Keep core 0 and at least one more for the OS and unpinned threads.
+	if (index + 2 >= topology.physical_core_count)
+	{
+		return 0;
+	}
+	return topology.core_affinity_masks[topology.physical_core_count - 1 - index];
+}
+
+static void set_thread_name(HANDLE h, const char* name)
+{
+	wchar_t wide_name[64];
+	if (MultiByteToWideChar(CP_UTF8, 0, name, -1, wide_name, (int)_countof(wide_name)) > 0)
+	{
+		SetThreadDescription(h, wide_name);
+	}
+}
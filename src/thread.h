@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 // Threading support.
@@ -7,14 +8,70 @@
 // Handle to a thread.
 typedef struct thread_t thread_t;
 
+// Maximum number of logical processors described by thread_topology_t.
+enum
+{
+	k_thread_max_cores = 64,
+};
+
+// Scheduling priority class of a thread.
+typedef enum thread_priority_t
+{
+	// Leave the priority the OS gives new threads.
+	k_thread_priority_default,
+	k_thread_priority_background,
+	k_thread_priority_low,
+	k_thread_priority_normal,
+	k_thread_priority_high,
+	k_thread_priority_critical,
+} thread_priority_t;
+
+// Optional properties of a new thread.
+// Zero-initialized fields take the OS default.
+typedef struct thread_info_t
+{
+	// Name shown in debuggers, profilers and trace output.
+	const char* name;
+	// Bit N set allows the thread to run on logical processor N. Zero means any.
+	uint64_t affinity_mask;
+	thread_priority_t priority;
+	// Stack reservation in bytes. Zero means the executable's default.
+	size_t stack_size;
+} thread_info_t;
+
+// Processor layout of the machine.
+typedef struct thread_topology_t
+{
+	int physical_core_count;
+	int logical_core_count;
+	// Mask of logical processors belonging to each physical core.
+	// Hyperthreaded siblings share a mask.
+	uint64_t core_affinity_masks[k_thread_max_cores];
+} thread_topology_t;
+
 // Creates a new thread.
 // Thread begins running function with data on return.
 thread_t* thread_create(int (*function)(void*), void* data);
 
+// Creates a new thread with a name, affinity, priority and stack size.
+// Thread begins running function with data on return.
+thread_t* thread_create_ex(int (*function)(void*), void* data, const thread_info_t* info);
+
 // Waits for a thread to complete and destroys it.
 // Returns the thread's exit code.
-int thread_destroy(thread);
+int thread_destroy(thread_t* thread);
 
 // Puts the calling thread to sleep for the specified number of milliseconds.
 // Thread will sleep for *approximately* the specified time.
 void thread_sleep(uint32_t ms);
+
+// Sets the name of the calling thread.
+void thread_set_name(const char* name);
+
+// Queries the number of physical and logical cores on the machine.
+void thread_get_topology(thread_topology_t* topology);
+
+// Picks an affinity mask for a thread that should own a physical core.
+// Cores are handed out from the last one down, leaving core 0 to the main thread.
+// Returns zero (any core) if the machine has too few cores to spare one.
+uint64_t thread_get_dedicated_core_mask(int index);
@@ -1,12 +1,25 @@
 #include "timer.h"
 
+#include <intrin.h>
+#include <stdbool.h>
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+// How long timer_startup measures the timestamp counter against the OS clock.
+static const DWORD k_timer_calibration_ms = 20;
+
 static uint64_t s_ticks_start = 0;
 static double s_us_per_tick = 0.001;
 static double s_ms_per_tick = 0.000001;
 
+// Fast ticks come from the timestamp counter when it runs at a constant rate.
+static bool s_use_tsc = false;
+static uint64_t s_tsc_start = 0;
+static uint64_t s_tsc_per_second = 0;
+
+static bool has_invariant_tsc();
+
 void timer_startup()
 {
 	s_ticks_start = timer_get_ticks();
@@ -14,6 +27,24 @@ void timer_startup()
 	uint64_t ticks_per_second = timer_get_ticks_per_second();
 	s_us_per_tick = 1000000.0 / ticks_per_second;
 	s_ms_per_tick = 1000.0 / ticks_per_second;
+
+	if (has_invariant_tsc())
+	{
+		// Count timestamp ticks across a known stretch of OS clock.
+		uint64_t ticks_begin = timer_get_ticks();
+		uint64_t tsc_begin = __rdtsc();
+		Sleep(k_timer_calibration_ms);
+		uint64_t ticks_end = timer_get_ticks();
+		uint64_t tsc_end = __rdtsc();
+
+		uint64_t elapsed_ticks = ticks_end - ticks_begin;
+		if (elapsed_ticks > 0 && tsc_end > tsc_begin)
+		{
+			s_tsc_per_second = (uint64_t)((double)(tsc_end - tsc_begin) * ticks_per_second / elapsed_ticks);
+			s_tsc_start = tsc_begin;
+			s_use_tsc = true;
+		}
+	}
 }
 
 uint64_t timer_ticks_to_us(uint64_t t)
@@ -39,3 +70,27 @@ uint64_t timer_get_ticks_per_second()
 	QueryPerformanceFrequency(&freq);
 	return freq.QuadPart;
 }
+
+uint64_t timer_get_fast_ticks()
+{
+	return s_use_tsc ? __rdtsc() - s_tsc_start : timer_get_ticks();
+}
+
+uint64_t timer_get_fast_ticks_per_second()
+{
+	return s_use_tsc ? s_tsc_per_second : timer_get_ticks_per_second();
+}
+
+static bool has_invariant_tsc()
+{
+	// CPUID 0x80000007 EDX bit 8: the counter ticks at a constant rate across
+	// power states and cores, so it can be used as a clock.
+	int info[4];
+	__cpuid(info, 0x80000000);
+	if ((unsigned)info[0] < 0x80000007)
+	{
+		return false;
+	}
+	__cpuid(info, 0x80000007);
+	return (info[3] & (1 << 8)) != 0;
+}
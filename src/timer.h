@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 // Perform one-time initialization of the timer.
+// Also calibrates the fast timer, which takes a few tens of milliseconds.
 void timer_startup();
 
 // Get the number of OS-defined ticks that have elapsed since startup.
@@ -18,3 +19,12 @@ uint64_t timer_ticks_to_us(uint64_t t);
 
 // Convert a number of OS-defined ticks to milliseconds.
 uint32_t timer_ticks_to_ms(uint64_t t);
+
+// Get ticks from the cheapest clock available, for hot instrumentation.
+// Uses the CPU's invariant timestamp counter when it has one, calibrated at
+// timer_startup; otherwise the same clock as timer_get_ticks.
+// Not comparable with timer_get_ticks; store raw and convert later.
+uint64_t timer_get_fast_ticks();
+
+// Get the fast tick frequency.
+uint64_t timer_get_fast_ticks_per_second();
@@ -1,5 +1,6 @@
 #include "trace.h"
 
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -8,216 +9,1283 @@
 
 #include "timer.h"
 #include "atomic.h"
-#include "queue.h"
+#include "contention.h"
 #include "debug.h"
 #include "fs.h"
+#include "semaphore.h"
+#include "thread.h"
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
-typedef struct thread_queue_t thread_queue_t;
-typedef struct duration_t duration_t;
+enum
+{
+	k_trace_max_contention = 32,
+	k_trace_max_threads = 64,
+	// Nesting tracked per thread when matching durations on export.
+	k_trace_max_depth = 64,
+	// Worst case JSON for an event, not counting its name.
+	k_trace_event_json_size = 192,
+	k_trace_contention_json_size = 1024,
+	// Distinct call sites, and names recorded without one.
+	k_trace_max_sites = 4096,
+	k_trace_max_dynamic_names = 1024,
+	k_trace_write_batch = 256,
+	k_trace_write_interval_ms = 5,
+};
 
-typedef struct trace_t {
-	uint32_t max_duration;
-	char* path;
-	heap_t* heap;
-	duration_t** list_durations;
-	uint32_t num_duration;
-	thread_queue_t** thread_q;
-	uint32_t num_q;
-	bool start;
-} trace_t;
+// "GATR" at the start of a binary trace.
+static const uint32_t k_trace_file_magic = 0x52544147;
+static const uint32_t k_trace_file_version = 3;
 
-typedef struct duration_t {
-	char* name;
+// Binary trace layout: a file header, then records, each a record header and payload.
+// Records appear in the order they were written; a site or thread is always
+// written before the first record that refers to it.
+typedef struct trace_file_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t ticks_per_second;
 	uint32_t pid;
+	uint32_t reserved;
+} trace_file_header_t;
+
+typedef enum trace_record_kind_t
+{
+	// Payload is a trace_record_site_t followed by the name's then the file's characters.
+	k_trace_record_site = 1,
+	// Payload is a trace_record_thread_t.
+	k_trace_record_thread,
+	// Payload is a trace_record_events_t followed by count trace_packed_event_t.
+	k_trace_record_events,
+	// Payload is a trace_record_contention_t.
+	k_trace_record_contention,
+} trace_record_kind_t;
+
+typedef struct trace_record_header_t
+{
+	uint32_t kind;
+	// Payload size in bytes, so readers can skip kinds they do not know.
+	uint32_t size;
+} trace_record_header_t;
+
+typedef struct trace_record_site_t
+{
+	uint32_t id;
+	uint32_t line;
+	uint32_t name_size;
+	uint32_t file_size;
+} trace_record_site_t;
+
+typedef struct trace_record_thread_t
+{
+	uint32_t index;
 	uint32_t tid;
-	uint64_t ts;
-	char ph;
-} duration_t;
+} trace_record_thread_t;
+
+typedef struct trace_record_events_t
+{
+	uint32_t thread_index;
+	uint32_t count;
+} trace_record_events_t;
+
+typedef struct trace_packed_event_t
+{
+	uint64_t ticks;
+	int64_t value;
+	// Zero for events with no name.
+	uint32_t site_id;
+	uint8_t phase;
+	uint8_t reserved[3];
+} trace_packed_event_t;
+
+typedef struct trace_record_contention_t
+{
+	uint32_t site_id;
+	int32_t max_depth;
+	int64_t acquire_count;
+	int64_t contended_count;
+	int64_t total_wait_us;
+	int64_t max_wait_us;
+	int64_t wait_histogram[k_contention_histogram_buckets];
+} trace_record_contention_t;
+
+// Matches duration begins to ends on one thread while exporting,
+// to turn thread cycle counts into per-duration totals.
+typedef struct trace_cycle_stack_t
+{
+	int64_t begins[k_trace_max_depth];
+	int32_t depth;
+} trace_cycle_stack_t;
+
+// A call site read back from a binary trace.
+typedef struct trace_convert_site_t
+{
+	char* name;
+	const char* file;
+	uint32_t line;
+} trace_convert_site_t;
+
+// Reads a binary trace front to back, a stream piece at a time.
+typedef struct trace_reader_t
+{
+	fs_stream_t* stream;
+	const uint8_t* piece;
+	size_t piece_size;
+	size_t offset;
+} trace_reader_t;
+
+typedef enum trace_mode_t
+{
+	k_trace_mode_off,
+	// Stream to a file as recorded, dropping events if the writer falls behind.
+	k_trace_mode_capture,
+	// Record forever, overwriting the oldest events, write out on demand.
+	k_trace_mode_flight_recorder,
+} trace_mode_t;
+
+// One recorded event.
+typedef struct trace_event_t
+{
+	uint64_t ticks;
+	// Counter value, flow id, or the thread's cycle count for durations when counting cycles.
+	int64_t value;
+	// Index into the trace's call sites; zero for events with no name.
+	uint32_t site;
+	// 'B' and 'E' for durations, 'C' counter, 'i' instant, 's' and 'f' flow begin and end.
+	char phase;
+} trace_event_t;
 
-// store the name of duration for each thread
-typedef struct thread_queue_t {
+// Events recorded by one thread. Only the owning thread writes to it.
+typedef struct trace_thread_t
+{
 	uint32_t tid;
-	char** q;
-	uint32_t head_index;
-	uint32_t end_index;
-}thread_queue_t;
+	// Capture the events belong to; a new capture restarts the buffer.
+	int32_t generation;
+	// Events recorded this capture. Keeps counting past capacity in flight recorder mode.
+	int32_t count;
+	int32_t dropped;
+	// Events the capture writer has consumed. Reset by the owning thread when a
+	// capture begins, otherwise only the writer thread writes to it.
+	int32_t read_count;
+	// Set while the owning thread is inside thread_record, so stopping a
+	// capture can wait for events already past the mode check.
+	int32_t recording;
+	// Always a power of two, so a running count wraps around the ring.
+	int32_t capacity;
+	trace_event_t* events;
+} trace_thread_t;
+
+// Events from one thread to write out.
+typedef struct trace_span_t
+{
+	const trace_thread_t* thread;
+	const trace_event_t* events;
+	int32_t count;
+} trace_span_t;
+
+// A flight recorder dump waiting for the dump thread.
+typedef struct trace_dump_t
+{
+	char path[260];
+	trace_span_t spans[k_trace_max_threads];
+	int32_t span_count;
+} trace_dump_t;
+
+typedef struct trace_t
+{
+	heap_t* heap;
+	int32_t event_capacity;
+	char* path;
+	uint32_t pid;
+	// Per-thread buffer, registered on a thread's first event.
+	DWORD tls_index;
+	trace_thread_t* threads[k_trace_max_threads];
+	int32_t thread_count;
+	// Stand-in for threads past k_trace_max_threads; drops everything.
+	trace_thread_t overflow_thread;
+	const contention_t* contentions[k_trace_max_contention];
+	int32_t num_contention;
+	int32_t generation;
+	trace_mode_t mode;
+	bool count_cycles;
+	// Registered call sites by id. Entries are written once, before the id is handed out.
+	trace_site_t* sites[k_trace_max_sites];
+	int32_t site_count;
+	// Sites standing in for names pushed without one, keyed by the name's address.
+	trace_site_t* dynamic_sites;
+	// Output for captures and flight recorder dumps. The game's, see
+	// trace_set_fs, or else one of our own created on first use.
+	fs_t* fs;
+	bool owns_fs;
+	// Flight recorder dumps are formatted and written on the dump thread.
+	// At most one waits while another is being written.
+	thread_t* dump_thread;
+	semaphore_t* dump_ready;
+	trace_dump_t* dump_pending;
+	int32_t dump_stop;
+	// Capture state. Events stream from thread buffers to the file on the writer thread.
+	fs_append_t* capture_file;
+	thread_t* writer_thread;
+	int32_t writer_stop;
+	// Bit per site id whose site record has been written.
+	uint64_t sites_written[k_trace_max_sites / 64];
+	// Bit per thread index whose thread record has been written.
+	uint64_t threads_announced;
+} trace_t;
 
-thread_queue_t* find_queue(trace_t* trace);
-void thread_queue_push(trace_t* trace, thread_queue_t* q, const char* name);
-char* thread_queue_pop(thread_queue_t* q);
-void destroy_thread_queue(heap_t* heap, thread_queue_t* q);
+static trace_thread_t* thread_get(trace_t* trace);
+static void thread_record(trace_t* trace, trace_thread_t* thread, uint32_t site, char phase, int64_t value);
+static uint32_t site_get_id(trace_t* trace, trace_site_t* site);
+static int64_t thread_cycles(trace_t* trace);
+static int64_t cycle_stack_apply(trace_cycle_stack_t* stack, char phase, int64_t value);
+static trace_site_t* site_get_dynamic(trace_t* trace, const char* name);
+static void write_json(trace_t* trace, const char* path, const trace_span_t* spans, int32_t span_count);
+static bool reader_read(trace_reader_t* reader, void* data, size_t size);
+static void json_printf(fs_append_t* out, const char* format, ...);
+static void json_append_string(fs_append_t* out, const char* string);
+static void json_append_escaped(fs_append_t* out, const char* string);
+static size_t json_escape(char* buffer, size_t size, const char* string);
+static void format_phase_fields(char* buffer, size_t size, char phase, int64_t value);
+static uint64_t ticks_to_us(uint64_t ticks, uint64_t ticks_per_second);
+static int writer_thread_func(void* user);
+static int dump_thread_func(void* user);
+static void dump_thread_stop(trace_t* trace);
+static void dump_free(trace_t* trace, trace_dump_t* dump);
+static void capture_drain(trace_t* trace);
+static void capture_write_site(trace_t* trace, uint32_t id);
+static void capture_write_record(trace_t* trace, trace_record_kind_t kind, const void* payload, size_t size, const void* extra, size_t extra_size);
 
 trace_t* trace_create(heap_t* heap, int event_capacity)
 {
 	trace_t* trace = heap_alloc(heap, sizeof(trace_t), 8);
-	trace->max_duration = event_capacity;
+	memset(trace, 0, sizeof(*trace));
 	trace->heap = heap;
-	trace->list_durations = heap_alloc(heap, event_capacity * sizeof(duration_t*), 8);
-	trace->num_duration = 0;
-	trace->thread_q = heap_alloc(heap, event_capacity * sizeof(thread_queue_t*), 8);
-	trace->num_q = 0;
-	trace->start = false;
-
+	trace->event_capacity = 1;
+	while (trace->event_capacity < event_capacity)
+	{
+		trace->event_capacity <<= 1;
+	}
+	trace->pid = GetCurrentProcessId();
+	trace->tls_index = TlsAlloc();
+	trace->dynamic_sites = heap_alloc(heap, sizeof(trace_site_t) * k_trace_max_dynamic_names * 2, 8);
+	memset(trace->dynamic_sites, 0, sizeof(trace_site_t) * k_trace_max_dynamic_names * 2);
 	return trace;
 }
 
 void trace_destroy(trace_t* trace)
 {
-	for (uint32_t i = 0; i < trace->num_duration; i++) {
-		heap_free(trace->heap, (trace->list_durations)[i]->name);
-		heap_free(trace->heap, (trace->list_durations)[i]);
+	trace_capture_stop(trace);
+	dump_thread_stop(trace);
+	for (int32_t i = 0; i < __min(trace->thread_count, k_trace_max_threads); i++)
+	{
+		if (trace->threads[i])
+		{
+			heap_free(trace->heap, trace->threads[i]);
+		}
 	}
-	heap_free(trace->heap, trace->list_durations);
-
-	for (uint32_t i = 0; i < trace->num_q; i++) {
-		destroy_thread_queue(trace->heap, (trace->thread_q)[i]);
+	if (trace->owns_fs)
+	{
+		fs_destroy(trace->fs);
+	}
+	TlsFree(trace->tls_index);
+	heap_free(trace->heap, trace->dynamic_sites);
+	if (trace->path)
+	{
+		heap_free(trace->heap, trace->path);
 	}
-	heap_free(trace->heap, trace->thread_q);
-
-	heap_free(trace->heap, trace->path);
-
 	heap_free(trace->heap, trace);
 }
 
 void trace_duration_push(trace_t* trace, const char* name)
 {
-	if (!trace->start) return;
+	if (!trace || trace->mode == k_trace_mode_off) return;
+	thread_record(trace, thread_get(trace), site_get_id(trace, site_get_dynamic(trace, name)), 'B', thread_cycles(trace));
+}
+
+void trace_site_push(trace_t* trace, trace_site_t* site)
+{
+	if (!trace || trace->mode == k_trace_mode_off) return;
+	thread_record(trace, thread_get(trace), site_get_id(trace, site), 'B', thread_cycles(trace));
+}
+
+void trace_duration_pop(trace_t* trace)
+{
+	if (!trace || trace->mode == k_trace_mode_off) return;
+	thread_record(trace, thread_get(trace), 0, 'E', thread_cycles(trace));
+}
+
+void trace_set_fs(trace_t* trace, fs_t* fs)
+{
+	trace->fs = fs;
+}
+
+void trace_set_cycle_counting(trace_t* trace, bool enabled)
+{
+	trace->count_cycles = enabled;
+}
+
+void trace_site_counter(trace_t* trace, trace_site_t* site, int64_t value)
+{
+	if (!trace || trace->mode == k_trace_mode_off) return;
+	thread_record(trace, thread_get(trace), site_get_id(trace, site), 'C', value);
+}
+
+void trace_site_instant(trace_t* trace, trace_site_t* site)
+{
+	if (!trace || trace->mode == k_trace_mode_off) return;
+	thread_record(trace, thread_get(trace), site_get_id(trace, site), 'i', 0);
+}
+
+void trace_site_flow_begin(trace_t* trace, trace_site_t* site, uint64_t id)
+{
+	if (!trace || trace->mode == k_trace_mode_off) return;
+	thread_record(trace, thread_get(trace), site_get_id(trace, site), 's', (int64_t)id);
+}
+
+void trace_site_flow_end(trace_t* trace, trace_site_t* site, uint64_t id)
+{
+	if (!trace || trace->mode == k_trace_mode_off) return;
+	thread_record(trace, thread_get(trace), site_get_id(trace, site), 'f', (int64_t)id);
+}
+
+void trace_capture_start(trace_t* trace, const char* path)
+{
+	if (trace->mode == k_trace_mode_capture)
+	{
+		trace_capture_stop(trace);
+	}
+	if (trace->path)
+	{
+		heap_free(trace->heap, trace->path);
+	}
+	size_t path_size = strlen(path) + 1;
+	trace->path = heap_alloc(trace->heap, path_size, 8);
+	memcpy(trace->path, path, path_size);
+
+	if (!trace->fs)
+	{
+		trace->fs = fs_create(trace->heap, 16);
+		trace->owns_fs = true;
+	}
+	trace->capture_file = fs_open_append(trace->fs, path, trace->heap, true);
+	trace_file_header_t header =
+	{
+		.magic = k_trace_file_magic,
+		.version = k_trace_file_version,
+		.ticks_per_second = timer_get_fast_ticks_per_second(),
+		.pid = trace->pid,
+	};
+	fs_append(trace->capture_file, &header, sizeof(header));
+
+	memset(trace->sites_written, 0, sizeof(trace->sites_written));
+	trace->threads_announced = 0;
+	trace->writer_stop = 0;
+
+	// Threads notice the new generation on their next event and restart their buffers.
+	atomic_fetch_add32(&trace->generation, 1, k_atomic_seq_cst);
+	trace->mode = k_trace_mode_capture;
+
+	thread_info_t writer_info = { .name = "trace writer", .priority = k_thread_priority_low };
+	trace->writer_thread = thread_create_ex(writer_thread_func, trace, &writer_info);
+}
 
-	uint32_t old_num = atomic_increment(&(trace->num_duration));
-	if (old_num >= trace->max_duration) {
-		debug_print(k_print_warning, "Exceed max duration count");
+void trace_capture_stop(trace_t* trace)
+{
+	if (trace->mode != k_trace_mode_capture)
+	{
 		return;
 	}
+	atomic_store32((volatile int32_t*)&trace->mode, k_trace_mode_off, k_atomic_relaxed);
 
-	duration_t* tmp_duration = heap_alloc(trace->heap, sizeof(duration_t), 8);
-	// +1 to include '\0'
-	tmp_duration->name = heap_alloc(trace->heap, strlen(name) + 1, 8);
-	strncpy_s(tmp_duration->name, strlen(name) + 1, name, strlen(name)+1);
-	tmp_duration->pid = GetCurrentProcessId();
-	tmp_duration->tid = GetCurrentThreadId();
-	tmp_duration->ts = timer_ticks_to_us(timer_get_ticks());
-	tmp_duration->ph = 'B';
+	// Wait out events that passed the mode check before it changed, so the
+	// final drain sees them. Flushing every processor's store buffer makes a
+	// recording flag set before that check visible here, without recorders
+	// paying for a fence on every event.
+	FlushProcessWriteBuffers();
+	int32_t recorder_count = __min(atomic_load32(&trace->thread_count, k_atomic_acquire), k_trace_max_threads);
+	for (int32_t t = 0; t < recorder_count; t++)
+	{
+		trace_thread_t* thread = atomic_load_ptr((void* const volatile*)&trace->threads[t], k_atomic_acquire);
+		while (thread && atomic_load32(&thread->recording, k_atomic_acquire))
+		{
+			atomic_pause();
+		}
+	}
+
+	// The writer drains whatever is left before it exits.
+	atomic_store32(&trace->writer_stop, 1, k_atomic_release);
+	thread_destroy(trace->writer_thread);
+	trace->writer_thread = NULL;
+
+	int32_t thread_count = __min(atomic_load32(&trace->thread_count, k_atomic_acquire), k_trace_max_threads);
+	int32_t dropped = 0;
+	for (int32_t t = 0; t < thread_count; t++)
+	{
+		trace_thread_t* thread = atomic_load_ptr((void* const volatile*)&trace->threads[t], k_atomic_acquire);
+		if (thread && atomic_load32(&thread->generation, k_atomic_relaxed) == trace->generation)
+		{
+			dropped += atomic_load32(&thread->dropped, k_atomic_relaxed);
+		}
+	}
+	if (dropped)
+	{
+		debug_print(k_print_warning, "Trace dropped %d events, increase event capacity\n", dropped);
+	}
 
-	(trace->list_durations)[old_num] = tmp_duration;
+	for (int32_t i = 0; i < trace->num_contention; i++)
+	{
+		const contention_t* tmp = trace->contentions[i];
+		uint32_t site_id = site_get_id(trace, site_get_dynamic(trace, tmp->name));
+		capture_write_site(trace, site_id);
+		trace_record_contention_t record =
+		{
+			.site_id = site_id,
+			.max_depth = tmp->max_depth,
+			.acquire_count = tmp->acquire_count,
+			.contended_count = tmp->contended_count,
+			.total_wait_us = tmp->total_wait_us,
+			.max_wait_us = tmp->max_wait_us,
+		};
+		memcpy(record.wait_histogram, tmp->wait_histogram, sizeof(record.wait_histogram));
+		capture_write_record(trace, k_trace_record_contention, &record, sizeof(record), NULL, 0);
+	}
 
-	thread_queue_t* tmp_queue = find_queue(trace);
-	thread_queue_push(trace, tmp_queue, name);
+	int result = fs_append_get_result(trace->capture_file);
+	if (result)
+	{
+		debug_print(k_print_error, "Trace failed to write %s: %d\n", trace->path, result);
+	}
+	fs_append_close(trace->capture_file);
+	trace->capture_file = NULL;
 }
 
-void trace_duration_pop(trace_t* trace)
+void trace_flight_recorder_start(trace_t* trace)
+{
+	trace_capture_stop(trace);
+	if (!trace->fs)
+	{
+		trace->fs = fs_create(trace->heap, 16);
+		trace->owns_fs = true;
+	}
+	if (!trace->dump_thread)
+	{
+		trace->dump_ready = semaphore_create(0, 1024);
+		trace->dump_stop = 0;
+		thread_info_t dump_info = { .name = "trace dump", .priority = k_thread_priority_low };
+		trace->dump_thread = thread_create_ex(dump_thread_func, trace, &dump_info);
+	}
+	atomic_fetch_add32(&trace->generation, 1, k_atomic_seq_cst);
+	trace->mode = k_trace_mode_flight_recorder;
+}
+
+void trace_flight_recorder_stop(trace_t* trace)
 {
-	if (!trace->start) return;
+	if (trace->mode == k_trace_mode_flight_recorder)
+	{
+		trace->mode = k_trace_mode_off;
+	}
+	dump_thread_stop(trace);
+}
 
-	thread_queue_t* tmp_queue = find_queue(trace);
-	char* name = thread_queue_pop(tmp_queue);
-	if (name == NULL) {
-		debug_print(k_print_warning, "Nothing in the thread queue to pop.");
+void trace_flight_recorder_dump(trace_t* trace, const char* path, uint32_t seconds)
+{
+	if (trace->mode != k_trace_mode_flight_recorder)
+	{
+		debug_print(k_print_warning, "Trace flight recorder dump requested while it is not running\n");
+		return;
+	}
+	if (atomic_load_ptr((void* const volatile*)&trace->dump_pending, k_atomic_acquire))
+	{
+		debug_print(k_print_warning, "Trace dump %s skipped, the previous dump is still queued\n", path);
 		return;
 	}
 
-	uint32_t old_num = atomic_increment(&(trace->num_duration));
-	if (old_num >= trace->max_duration) {
-		debug_print(k_print_warning, "Exceed max duration count");
+	trace_dump_t* dump = heap_alloc(trace->heap, sizeof(trace_dump_t), 8);
+	strcpy_s(dump->path, sizeof(dump->path), path);
+	trace_span_t* spans = dump->spans;
+	int32_t span_count = 0;
+
+	uint64_t now = timer_get_fast_ticks();
+	uint64_t window = (uint64_t)seconds * timer_get_fast_ticks_per_second();
+	uint64_t oldest = now > window ? now - window : 0;
+
+	// Threads keep recording while they are copied, so copy each ring and then
+	// discard anything the thread may have overwritten during the copy.
+	int32_t thread_count = __min(atomic_load32(&trace->thread_count, k_atomic_acquire), k_trace_max_threads);
+	for (int32_t t = 0; t < thread_count; t++)
+	{
+		trace_thread_t* thread = atomic_load_ptr((void* const volatile*)&trace->threads[t], k_atomic_acquire);
+		if (!thread || atomic_load32(&thread->generation, k_atomic_relaxed) != trace->generation)
+		{
+			continue;
+		}
+
+		uint32_t capacity = (uint32_t)thread->capacity;
+		uint32_t end = (uint32_t)atomic_load32(&thread->count, k_atomic_acquire);
+		uint32_t begin = end > capacity ? end - capacity : 0;
+		trace_event_t* events = heap_alloc(trace->heap, sizeof(trace_event_t) * __max(end - begin, 1), 8);
+		for (uint32_t i = begin; i != end; i++)
+		{
+			events[i - begin] = thread->events[i & (capacity - 1)];
+		}
+
+		atomic_fence(k_atomic_acquire);
+		uint32_t now_end = (uint32_t)atomic_load32(&thread->count, k_atomic_relaxed);
+		uint32_t valid_begin = now_end - begin >= capacity ? now_end - capacity + 1 : begin;
+
+		int32_t count = 0;
+		for (uint32_t i = valid_begin; i != end && (int32_t)(end - i) > 0; i++)
+		{
+			const trace_event_t* event = &events[i - begin];
+			if (event->ticks >= oldest)
+			{
+				events[count++] = *event;
+			}
+		}
+
+		spans[span_count].thread = thread;
+		spans[span_count].events = events;
+		spans[span_count].count = count;
+		span_count++;
+	}
+	dump->span_count = span_count;
+
+	// Formatting and writing take far longer than the copy; leave them to the dump thread.
+	void* expected = NULL;
+	if (!atomic_compare_exchange_ptr((void* volatile*)&trace->dump_pending, &expected, dump, k_atomic_release))
+	{
+		debug_print(k_print_warning, "Trace dump %s skipped, the previous dump is still queued\n", path);
+		dump_free(trace, dump);
 		return;
 	}
+	semaphore_release(trace->dump_ready);
+}
+
+void trace_add_contention(trace_t* trace, const contention_t* contention)
+{
+	if (trace->num_contention >= k_trace_max_contention) {
+		debug_print(k_print_warning, "Exceed max contention count");
+		return;
+	}
+	trace->contentions[trace->num_contention++] = contention;
+}
+
+int trace_convert_to_json(heap_t* heap, const char* binary_path, const char* json_path)
+{
+	fs_t* fs = fs_create(heap, 16);
+	trace_reader_t reader = { .stream = fs_open_stream(fs, binary_path, heap, false) };
+
+	trace_file_header_t header;
+	if (!reader_read(&reader, &header, sizeof(header)) ||
+		header.magic != k_trace_file_magic ||
+		header.version != k_trace_file_version ||
+		header.ticks_per_second == 0)
+	{
+		int result = fs_stream_get_result(reader.stream);
+		debug_print(k_print_error, "Trace file %s could not be read: %d\n", binary_path, result);
+		fs_stream_close(reader.stream);
+		fs_destroy(fs);
+		return result ? result : -1;
+	}
+
+	// Only the site and thread tables are kept; events go straight to the output.
+	trace_convert_site_t* sites = heap_alloc(heap, sizeof(trace_convert_site_t) * k_trace_max_sites, 8);
+	memset(sites, 0, sizeof(trace_convert_site_t) * k_trace_max_sites);
+	uint32_t tids[k_trace_max_threads] = { 0 };
+	trace_cycle_stack_t* stacks = heap_alloc(heap, sizeof(trace_cycle_stack_t) * k_trace_max_threads, 8);
+	memset(stacks, 0, sizeof(trace_cycle_stack_t) * k_trace_max_threads);
+	uint64_t last_us = 0;
+
+	fs_append_t* out = fs_open_append(fs, json_path, heap, true);
+	json_printf(out, "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\" : [\n");
+	const char* separator = "";
+
+	bool truncated = false;
+	trace_record_header_t record;
+	while (!truncated && reader_read(&reader, &record, sizeof(record)))
+	{
+		if (record.kind == k_trace_record_site && record.size >= sizeof(trace_record_site_t))
+		{
+			trace_record_site_t site;
+			truncated = !reader_read(&reader, &site, sizeof(site));
+			if (!truncated && record.size != sizeof(site) + (uint64_t)site.name_size + site.file_size)
+			{
+				truncated = true;
+			}
+			else if (!truncated && site.id >= 1 && site.id < k_trace_max_sites && !sites[site.id].name)
+			{
+				// Name and file share one allocation.
+				char* strings = heap_alloc(heap, (size_t)site.name_size + site.file_size + 2, 8);
+				truncated = !reader_read(&reader, strings, (size_t)site.name_size + site.file_size);
+				memmove(strings + site.name_size + 1, strings + site.name_size, site.file_size);
+				strings[site.name_size] = '\0';
+				strings[site.name_size + 1 + site.file_size] = '\0';
+				sites[site.id].name = strings;
+				sites[site.id].file = site.file_size ? strings + site.name_size + 1 : NULL;
+				sites[site.id].line = site.line;
+			}
+			else if (!truncated)
+			{
+				truncated = !reader_read(&reader, NULL, (size_t)site.name_size + site.file_size);
+			}
+		}
+		else if (record.kind == k_trace_record_thread && record.size == sizeof(trace_record_thread_t))
+		{
+			trace_record_thread_t thread;
+			truncated = !reader_read(&reader, &thread, sizeof(thread));
+			if (!truncated && thread.index < k_trace_max_threads)
+			{
+				tids[thread.index] = thread.tid;
+			}
+		}
+		else if (record.kind == k_trace_record_events && record.size >= sizeof(trace_record_events_t))
+		{
+			trace_record_events_t events;
+			truncated = !reader_read(&reader, &events, sizeof(events));
+			if (!truncated && record.size != sizeof(events) + (uint64_t)events.count * sizeof(trace_packed_event_t))
+			{
+				truncated = true;
+			}
+			uint32_t tid = events.thread_index < k_trace_max_threads ? tids[events.thread_index] : 0;
+			trace_cycle_stack_t* stack = &stacks[events.thread_index < k_trace_max_threads ? events.thread_index : 0];
+			for (uint32_t i = 0; !truncated && i < events.count; i++)
+			{
+				trace_packed_event_t event;
+				if (!reader_read(&reader, &event, sizeof(event)))
+				{
+					truncated = true;
+					break;
+				}
+				last_us = ticks_to_us(event.ticks, header.ticks_per_second);
+				char fields[k_trace_event_json_size];
+				format_phase_fields(fields, sizeof(fields), event.phase, cycle_stack_apply(stack, event.phase, event.value));
+				const trace_convert_site_t* site = event.site_id < k_trace_max_sites ? &sites[event.site_id] : &sites[0];
+				if (site->name)
+				{
+					json_printf(out, "%s\t\t{\"name\": ", separator);
+					json_append_string(out, site->name);
+					json_printf(out, ",\"ph\": \"%c\",\"pid\":%u,\"tid\":\"%u\",\"ts\":%llu%s", event.phase, header.pid, tid, last_us, fields);
+					if (site->file && event.phase == 'B')
+					{
+						json_printf(out, ",\"args\":{\"file\":");
+						json_append_string(out, site->file);
+						json_printf(out, ",\"line\":%u}", site->line);
+					}
+					json_printf(out, "}");
+				}
+				else
+				{
+					json_printf(out, "%s\t\t{\"ph\": \"%c\",\"pid\":%u,\"tid\":\"%u\",\"ts\":%llu%s}",
+						separator, event.phase, header.pid, tid, last_us, fields);
+				}
+				separator = ",\n";
+			}
+		}
+		else if (record.kind == k_trace_record_contention && record.size == sizeof(trace_record_contention_t))
+		{
+			trace_record_contention_t tmp;
+			truncated = !reader_read(&reader, &tmp, sizeof(tmp));
+			const char* name = tmp.site_id < k_trace_max_sites ? sites[tmp.site_id].name : NULL;
+			if (!truncated)
+			{
+				json_printf(out, "%s\t\t{\"name\": \"contention ", separator);
+				json_append_escaped(out, name ? name : "");
+				json_printf(out, "\",\"ph\": \"i\",\"s\": \"g\",\"pid\":%u,\"tid\":\"0\",\"ts\":%llu,"
+					"\"args\":{\"acquires\":%lld,\"contended\":%lld,\"wait_us\":%lld,\"max_wait_us\":%lld,\"max_depth\":%d,\"wait_histogram_log2_us\":[",
+					header.pid, last_us,
+					tmp.acquire_count, tmp.contended_count, tmp.total_wait_us, tmp.max_wait_us, tmp.max_depth);
+				for (int b = 0; b < k_contention_histogram_buckets; b++)
+				{
+					json_printf(out, "%lld%s", tmp.wait_histogram[b], (b == k_contention_histogram_buckets - 1) ? "" : ",");
+				}
+				json_printf(out, "]}}");
+				separator = ",\n";
+			}
+		}
+		else
+		{
+			// Unknown to this version, or malformed.
+			truncated = !reader_read(&reader, NULL, record.size);
+		}
+	}
 
-	duration_t* tmp_duration = heap_alloc(trace->heap, sizeof(duration_t), 8);
-	tmp_duration->name = name;
-	tmp_duration->pid = GetCurrentProcessId();
-	tmp_duration->tid = GetCurrentThreadId();
-	tmp_duration->ts = timer_ticks_to_us(timer_get_ticks());
-	tmp_duration->ph = 'E';
+	json_printf(out, "\n\t]\n}\n");
 
-	(trace->list_durations)[old_num] = tmp_duration;
+	int result = fs_stream_get_result(reader.stream);
+	if (!result && truncated)
+	{
+		debug_print(k_print_warning, "Trace file %s ends mid-record, converted what was complete\n", binary_path);
+		result = -1;
+	}
+	int write_result = fs_append_get_result(out);
+	if (write_result)
+	{
+		debug_print(k_print_error, "Trace failed to write %s: %d\n", json_path, write_result);
+		result = write_result;
+	}
 
+	fs_append_close(out);
+	fs_stream_close(reader.stream);
+	for (int32_t i = 0; i < k_trace_max_sites; i++)
+	{
+		if (sites[i].name)
+		{
+			heap_free(heap, sites[i].name);
+		}
+	}
+	heap_free(heap, sites);
+	heap_free(heap, stacks);
+	fs_destroy(fs);
+	return result;
 }
 
-void trace_capture_start(trace_t* trace, const char* path)
+// Copy the next size bytes of a binary trace to data, or skip them if data is NULL.
+// Returns false if the file ends first.
+static bool reader_read(trace_reader_t* reader, void* data, size_t size)
 {
-	trace->start = true;
-	trace->path = heap_alloc(trace->heap, strlen(path) + 1, 8);
-	strncpy_s(trace->path, strlen(path) + 1, path, strlen(path));
+	uint8_t* bytes = data;
+	while (size > 0)
+	{
+		if (reader->offset == reader->piece_size)
+		{
+			reader->piece = fs_stream_read(reader->stream, &reader->piece_size);
+			reader->offset = 0;
+			if (!reader->piece)
+			{
+				reader->piece_size = 0;
+				return false;
+			}
+		}
+		size_t copy_size = __min(size, reader->piece_size - reader->offset);
+		if (bytes)
+		{
+			memcpy(bytes, reader->piece + reader->offset, copy_size);
+			bytes += copy_size;
+		}
+		reader->offset += copy_size;
+		size -= copy_size;
+	}
+	return true;
 }
 
-void trace_capture_stop(trace_t* trace)
+static void json_printf(fs_append_t* out, const char* format, ...)
 {
-	trace->start = false;
+	char buffer[k_trace_contention_json_size];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	if (length > 0)
+	{
+		fs_append(out, buffer, __min((size_t)length, sizeof(buffer) - 1));
+	}
+}
 
-	fs_t* file = fs_create(trace->heap, 16);
+// Escape one character for a JSON string.
+// Returns the length written to escaped, or zero if the character is written as is.
+static int json_escape_char(char c, char escaped[8])
+{
+	if (c == '"' || c == '\\')
+	{
+		escaped[0] = '\\';
+		escaped[1] = c;
+		return 2;
+	}
+	if ((unsigned char)c < 0x20)
+	{
+		return sprintf_s(escaped, 8, "\\u%04x", (unsigned)c);
+	}
+	return 0;
+}
 
-	uint32_t size = 200 * (trace->num_duration + 1);
-	char* buffer = heap_alloc(trace->heap, size, 8);
+// Append a quoted JSON string, escaping as needed, e.g. for Windows paths.
+static void json_append_string(fs_append_t* out, const char* string)
+{
+	fs_append(out, "\"", 1);
+	json_append_escaped(out, string);
+	fs_append(out, "\"", 1);
+}
+
+// Append the inside of a JSON string, escaping as needed.
+static void json_append_escaped(fs_append_t* out, const char* string)
+{
+	const char* run = string;
+	for (const char* c = string; *c; c++)
+	{
+		char escaped[8];
+		int escaped_length = json_escape_char(*c, escaped);
+		if (escaped_length)
+		{
+			fs_append(out, run, c - run);
+			fs_append(out, escaped, escaped_length);
+			run = c + 1;
+		}
+	}
+	fs_append(out, run, strlen(run));
+}
+
+// Write the inside of a JSON string to buffer, escaping as needed. With a NULL
+// buffer nothing is written, to measure first.
+// Returns the escaped length, not counting the terminator.
+static size_t json_escape(char* buffer, size_t size, const char* string)
+{
+	size_t length = 0;
+	for (const char* c = string; *c; c++)
+	{
+		char escaped[8];
+		int escaped_length = json_escape_char(*c, escaped);
+		if (!escaped_length)
+		{
+			escaped[0] = *c;
+			escaped_length = 1;
+		}
+		if (buffer && length + escaped_length < size)
+		{
+			memcpy(buffer + length, escaped, escaped_length);
+		}
+		length += escaped_length;
+	}
+	if (buffer && size)
+	{
+		buffer[__min(length, size - 1)] = '\0';
+	}
+	return length;
+}
+
+// Format the fields particular to an event's phase, such as a counter's value or a flow's id.
+static void format_phase_fields(char* buffer, size_t size, char phase, int64_t value)
+{
+	switch (phase)
+	{
+	case 'C':
+		sprintf_s(buffer, size, ",\"args\":{\"value\":%lld}", value);
+		break;
+	case 'i':
+		sprintf_s(buffer, size, ",\"s\":\"t\"");
+		break;
+	case 's':
+		sprintf_s(buffer, size, ",\"cat\":\"flow\",\"id\":%llu", (uint64_t)value);
+		break;
+	case 'f':
+		// Bind to the enclosing slice rather than the next one to begin.
+		sprintf_s(buffer, size, ",\"cat\":\"flow\",\"id\":%llu,\"bp\":\"e\"", (uint64_t)value);
+		break;
+	case 'E':
+		if (value > 0)
+		{
+			sprintf_s(buffer, size, ",\"args\":{\"cycles\":%lld}", value);
+		}
+		else
+		{
+			buffer[0] = '\0';
+		}
+		break;
+	default:
+		buffer[0] = '\0';
+		break;
+	}
+}
+
+static uint64_t ticks_to_us(uint64_t ticks, uint64_t ticks_per_second)
+{
+	// Split to avoid overflowing the multiply on long uptimes.
+	return ticks / ticks_per_second * 1000000 + ticks % ticks_per_second * 1000000 / ticks_per_second;
+}
+
+// Write events to a Chrome trace file, along with contention statistics.
+static void write_json(trace_t* trace, const char* path, const trace_span_t* spans, int32_t span_count)
+{
+	// Size the output up front so it is written in one pass.
+	// Names are escaped as the converter does, so size for their escaped length.
+	size_t size = 256;
+	for (int32_t s = 0; s < span_count; s++)
+	{
+		for (int32_t i = 0; i < spans[s].count; i++)
+		{
+			uint32_t site = spans[s].events[i].site;
+			size += k_trace_event_json_size + (site ? json_escape(NULL, 0, trace->sites[site]->name) : 0);
+		}
+	}
+	for (int32_t i = 0; i < trace->num_contention; i++)
+	{
+		size += k_trace_contention_json_size + json_escape(NULL, 0, trace->contentions[i]->name);
+	}
 
-	char* head = "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\" : [\n";
-	strncat_s(buffer, size, head, strlen(head));
+	char* buffer = heap_alloc(trace->heap, size, 8);
+	size_t length = 0;
+	length += sprintf_s(buffer + length, size - length, "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\" : [\n");
 
-	for (uint32_t i = 0; i < trace->num_duration; i++) {
-		char buf[200];
-		duration_t* tmp = (trace->list_durations)[i];
-		sprintf_s(buf, 200, "\t\t{\"name\": \"%s\",\"ph\": \"%c\",\"pid\":%u,\"tid\":\"%u\",\"ts\":%llu}%c\n\0",
-			tmp->name, tmp->ph, tmp->pid, tmp->tid, tmp->ts, (i == trace->num_duration - 1) ? ' ' : ',');
-		strncat_s(buffer, size, buf, strlen(buf));
+	uint64_t ticks_per_second = timer_get_fast_ticks_per_second();
+	const char* separator = "";
+	for (int32_t s = 0; s < span_count; s++)
+	{
+		uint32_t tid = spans[s].thread->tid;
+		trace_cycle_stack_t stack = { .depth = 0 };
+		for (int32_t i = 0; i < spans[s].count; i++)
+		{
+			const trace_event_t* event = &spans[s].events[i];
+			char fields[k_trace_event_json_size];
+			format_phase_fields(fields, sizeof(fields), event->phase, cycle_stack_apply(&stack, event->phase, event->value));
+			if (event->site)
+			{
+				length += sprintf_s(buffer + length, size - length, "%s\t\t{\"name\": \"", separator);
+				length += json_escape(buffer + length, size - length, trace->sites[event->site]->name);
+				length += sprintf_s(buffer + length, size - length, "\",\"ph\": \"%c\",\"pid\":%u,\"tid\":\"%u\",\"ts\":%llu%s}",
+					event->phase, trace->pid, tid, ticks_to_us(event->ticks, ticks_per_second), fields);
+			}
+			else
+			{
+				length += sprintf_s(buffer + length, size - length, "%s\t\t{\"ph\": \"%c\",\"pid\":%u,\"tid\":\"%u\",\"ts\":%llu%s}",
+					separator, event->phase, trace->pid, tid, ticks_to_us(event->ticks, ticks_per_second), fields);
+			}
+			separator = ",\n";
+		}
 	}
 
-	char* tail = "\t]\n}\n";
-	strncat_s(buffer, size, tail, strlen(tail));
+	uint64_t now = ticks_to_us(timer_get_fast_ticks(), ticks_per_second);
+	for (int32_t i = 0; i < trace->num_contention; i++)
+	{
+		const contention_t* tmp = trace->contentions[i];
+		length += sprintf_s(buffer + length, size - length, "%s\t\t{\"name\": \"contention ", separator);
+		length += json_escape(buffer + length, size - length, tmp->name);
+		length += sprintf_s(buffer + length, size - length, "\",\"ph\": \"i\",\"s\": \"g\",\"pid\":%u,\"tid\":\"0\",\"ts\":%llu,"
+			"\"args\":{\"acquires\":%lld,\"contended\":%lld,\"wait_us\":%lld,\"max_wait_us\":%lld,\"max_depth\":%d,\"wait_histogram_log2_us\":[",
+			trace->pid, now,
+			tmp->acquire_count, tmp->contended_count, tmp->total_wait_us, tmp->max_wait_us, tmp->max_depth);
+		for (int b = 0; b < k_contention_histogram_buckets; b++)
+		{
+			length += sprintf_s(buffer + length, size - length, "%lld%s", tmp->wait_histogram[b], (b == k_contention_histogram_buckets - 1) ? "" : ",");
+		}
+		length += sprintf_s(buffer + length, size - length, "]}}");
+		separator = ",\n";
+	}
 
-	fs_work_t* worker = fs_write(file, trace->path, buffer, strlen(buffer), false);
+	length += sprintf_s(buffer + length, size - length, "\n\t]\n}\n");
 
-	fs_work_wait(worker);
-	fs_work_destroy(worker);
-	fs_destroy(file);
+	// Replace the file whole, so a viewer never opens a torn dump, and yield
+	// to reads the game is waiting on when it shares the game's fs.
+	fs_work_t* work = fs_save_ex(trace->fs, path, buffer, length, false, false, k_fs_priority_background);
+	fs_work_wait(work);
+	fs_work_destroy(work);
 	heap_free(trace->heap, buffer);
 }
 
-thread_queue_t* find_queue(trace_t* trace) {
-	uint32_t tid = GetCurrentThreadId();
-	for (uint32_t i = 0; i < trace->num_q; i++) {
-		if ((trace->thread_q)[i]->tid == tid)
-			return (trace->thread_q)[i];
+static int writer_thread_func(void* user)
+{
+	trace_t* trace = user;
+	while (!atomic_load32(&trace->writer_stop, k_atomic_acquire))
+	{
+		capture_drain(trace);
+		thread_sleep(k_trace_write_interval_ms);
 	}
+	capture_drain(trace);
+	return 0;
+}
 
-	// create thread_queue if not found
-	uint32_t old_num = atomic_increment(&(trace->num_q));
-	if (old_num >= trace->max_duration) {
-		debug_print(k_print_error, "Thread exceed limit");
-		return NULL;
+// Write each flight recorder dump handed over by trace_flight_recorder_dump,
+// until dump_thread_stop.
+static int dump_thread_func(void* user)
+{
+	trace_t* trace = user;
+	while (true)
+	{
+		semaphore_acquire(trace->dump_ready);
+		trace_dump_t* dump = atomic_exchange_ptr((void* volatile*)&trace->dump_pending, NULL, k_atomic_acquire);
+		if (dump)
+		{
+			write_json(trace, dump->path, dump->spans, dump->span_count);
+			dump_free(trace, dump);
+		}
+		if (atomic_load32(&trace->dump_stop, k_atomic_acquire))
+		{
+			break;
+		}
 	}
-	
-	thread_queue_t* tmp_q = heap_alloc(trace->heap, sizeof(thread_queue_t), 8);
-	tmp_q->q = heap_alloc(trace->heap, sizeof(char*), 8);
-	tmp_q->tid = tid;
-	tmp_q->head_index = 0;
-	tmp_q->end_index = 0;
-	(trace->thread_q)[old_num] = tmp_q;
+	return 0;
+}
 
-	return tmp_q;
+// Write out any queued dump and stop the dump thread.
+static void dump_thread_stop(trace_t* trace)
+{
+	if (!trace->dump_thread)
+	{
+		return;
+	}
+	atomic_store32(&trace->dump_stop, 1, k_atomic_release);
+	semaphore_release(trace->dump_ready);
+	thread_destroy(trace->dump_thread);
+	trace->dump_thread = NULL;
+	semaphore_destroy(trace->dump_ready);
+	trace->dump_ready = NULL;
+}
+
+static void dump_free(trace_t* trace, trace_dump_t* dump)
+{
+	for (int32_t i = 0; i < dump->span_count; i++)
+	{
+		heap_free(trace->heap, (void*)dump->spans[i].events);
+	}
+	heap_free(trace->heap, dump);
+}
+
+// Move everything recorded since the last drain from thread buffers to the file.
+static void capture_drain(trace_t* trace)
+{
+	int32_t generation = atomic_load32(&trace->generation, k_atomic_relaxed);
+	int32_t thread_count = __min(atomic_load32(&trace->thread_count, k_atomic_acquire), k_trace_max_threads);
+	for (int32_t t = 0; t < thread_count; t++)
+	{
+		trace_thread_t* thread = atomic_load_ptr((void* const volatile*)&trace->threads[t], k_atomic_acquire);
+		if (!thread || atomic_load32(&thread->generation, k_atomic_acquire) != generation)
+		{
+			continue;
+		}
+
+		uint32_t begin = (uint32_t)thread->read_count;
+		uint32_t end = (uint32_t)atomic_load32(&thread->count, k_atomic_acquire);
+		if (begin == end)
+		{
+			continue;
+		}
+
+		if (!(trace->threads_announced & (1ULL << t)))
+		{
+			trace_record_thread_t record = { .index = (uint32_t)t, .tid = thread->tid };
+			capture_write_record(trace, k_trace_record_thread, &record, sizeof(record), NULL, 0);
+			trace->threads_announced |= 1ULL << t;
+		}
+
+		uint32_t mask = (uint32_t)thread->capacity - 1;
+		while (begin != end)
+		{
+			trace_packed_event_t packed[k_trace_write_batch];
+			uint32_t count = __min(end - begin, (uint32_t)k_trace_write_batch);
+			for (uint32_t i = 0; i < count; i++)
+			{
+				const trace_event_t* event = &thread->events[(begin + i) & mask];
+				memset(&packed[i], 0, sizeof(packed[i]));
+				packed[i].ticks = event->ticks;
+				packed[i].site_id = event->site;
+				capture_write_site(trace, event->site);
+				packed[i].phase = (uint8_t)event->phase;
+				packed[i].value = event->value;
+			}
+			trace_record_events_t record = { .thread_index = (uint32_t)t, .count = count };
+			capture_write_record(trace, k_trace_record_events, &record, sizeof(record), packed, sizeof(packed[0]) * count);
+
+			// Hand the slots back to the recording thread.
+			begin += count;
+			atomic_store32(&thread->read_count, (int32_t)begin, k_atomic_release);
+		}
+	}
+	fs_append_flush(trace->capture_file);
 }
 
-void thread_queue_push(trace_t* trace, thread_queue_t* q, const char* name) {
-	if (q->end_index >= trace->max_duration) {
-		debug_print(k_print_error, "Queue exceed limit");
+// Write a site record the first time an id is seen in this capture.
+static void capture_write_site(trace_t* trace, uint32_t id)
+{
+	uint64_t bit = 1ULL << (id % 64);
+	if (!id || (trace->sites_written[id / 64] & bit))
+	{
 		return;
 	}
-	(q->q)[q->end_index] = heap_alloc(trace->heap, strlen(name) + 1, 8);
-	strncpy_s((q->q)[q->end_index], strlen(name) + 1, name, strlen(name) + 1);
-	q->end_index++;
+	trace->sites_written[id / 64] |= bit;
+
+	const trace_site_t* site = atomic_load_ptr((void* const volatile*)&trace->sites[id], k_atomic_acquire);
+	const char* file = site->file ? site->file : "";
+	trace_record_site_t record =
+	{
+		.id = id,
+		.line = (uint32_t)site->line,
+		.name_size = (uint32_t)strlen(site->name),
+		.file_size = (uint32_t)strlen(file),
+	};
+	trace_record_header_t header = { .kind = k_trace_record_site, .size = (uint32_t)(sizeof(record) + record.name_size + record.file_size) };
+	fs_append(trace->capture_file, &header, sizeof(header));
+	fs_append(trace->capture_file, &record, sizeof(record));
+	fs_append(trace->capture_file, site->name, record.name_size);
+	fs_append(trace->capture_file, file, record.file_size);
+}
+
+static void capture_write_record(trace_t* trace, trace_record_kind_t kind, const void* payload, size_t size, const void* extra, size_t extra_size)
+{
+	trace_record_header_t header = { .kind = (uint32_t)kind, .size = (uint32_t)(size + extra_size) };
+	fs_append(trace->capture_file, &header, sizeof(header));
+	fs_append(trace->capture_file, payload, size);
+	if (extra_size)
+	{
+		fs_append(trace->capture_file, extra, extra_size);
+	}
 }
 
-// if nothing at queue, return NULL
-char* thread_queue_pop(thread_queue_t* q) {
-	if (q->end_index - q->head_index <= 0) return NULL;
-	return (q->q)[q->head_index++];
+static trace_thread_t* thread_get(trace_t* trace)
+{
+	trace_thread_t* thread = TlsGetValue(trace->tls_index);
+	if (thread)
+	{
+		return thread;
+	}
+
+	int32_t index = atomic_fetch_add32(&trace->thread_count, 1, k_atomic_relaxed);
+	if (index >= k_trace_max_threads)
+	{
+		debug_print(k_print_warning, "Trace thread limit reached, events on this thread are dropped\n");
+		TlsSetValue(trace->tls_index, &trace->overflow_thread);
+		return &trace->overflow_thread;
+	}
+
+	// Events live right after the thread header, so registration is the only allocation.
+	thread = heap_alloc(trace->heap, sizeof(trace_thread_t) + sizeof(trace_event_t) * trace->event_capacity, 8);
+	thread->tid = GetCurrentThreadId();
+	thread->generation = 0;
+	thread->count = 0;
+	thread->dropped = 0;
+	thread->read_count = 0;
+	thread->capacity = trace->event_capacity;
+	thread->events = (trace_event_t*)(thread + 1);
+	TlsSetValue(trace->tls_index, thread);
+	atomic_store_ptr((void* volatile*)&trace->threads[index], thread, k_atomic_release);
+	return thread;
 }
 
-// all names poped out should be freed by outside functions
-void destroy_thread_queue(heap_t* heap, thread_queue_t* q) {
-	for (uint32_t i = q->head_index; i < (q->end_index); i++) {
-		heap_free(heap, (q->q)[i]);
+// Get a site's id in this trace, registering it on first use.
+// Registration is lock free: racing threads may each claim an id, but only one is kept.
+static uint32_t site_get_id(trace_t* trace, trace_site_t* site)
+{
+	if (!site)
+	{
+		return 0;
 	}
-	heap_free(heap, q->q);
-	heap_free(heap, q);
+
+	// The id is checked against the registry in case the site was registered with another trace.
+	int32_t id = atomic_load32(&site->id, k_atomic_acquire);
+	if (id > 0 && id < k_trace_max_sites && trace->sites[id] == site)
+	{
+		return (uint32_t)id;
+	}
+
+	int32_t new_id = atomic_fetch_add32(&trace->site_count, 1, k_atomic_relaxed) + 1;
+	if (new_id >= k_trace_max_sites)
+	{
+		if (new_id == k_trace_max_sites)
+		{
+			debug_print(k_print_warning, "Trace site limit reached, further sites are unnamed\n");
+		}
+		return 0;
+	}
+	atomic_store_ptr((void* volatile*)&trace->sites[new_id], site, k_atomic_release);
+	if (!atomic_compare_exchange32(&site->id, &id, new_id, k_atomic_release))
+	{
+		// Another thread registered it first; its id is now in id. Leaving the
+		// spare slot pointing at the site keeps anything that saw it valid.
+		return (uint32_t)id;
+	}
+	return (uint32_t)new_id;
+}
+
+// Get the site standing in for a name pushed without one, keyed by the name's address.
+static trace_site_t* site_get_dynamic(trace_t* trace, const char* name)
+{
+	uint32_t mask = k_trace_max_dynamic_names * 2 - 1;
+	uint32_t index = (uint32_t)(((uintptr_t)name >> 3) * 2654435761u) & mask;
+	for (uint32_t probe = 0; probe < k_trace_max_dynamic_names; probe++)
+	{
+		trace_site_t* site = &trace->dynamic_sites[index];
+		void* existing = atomic_load_ptr((void* const volatile*)&site->name, k_atomic_acquire);
+		if (!existing && atomic_compare_exchange_ptr((void* volatile*)&site->name, &existing, (void*)name, k_atomic_release))
+		{
+			return site;
+		}
+		// Already present, or another thread claimed the slot first with the same name.
+		if (existing == name)
+		{
+			return site;
+		}
+		index = (index + 1) & mask;
+	}
+	return NULL;
+}
+
+// Cycles the current thread has run, if counting is enabled.
+// Unlike ticks, these stop while the thread is not scheduled.
+static int64_t thread_cycles(trace_t* trace)
+{
+	if (!trace->count_cycles)
+	{
+		return 0;
+	}
+	ULONG64 cycles = 0;
+	QueryThreadCycleTime(GetCurrentThread(), &cycles);
+	return (int64_t)cycles;
+}
+
+// Get the value to export for an event: for a duration's end, the cycles since its begin.
+static int64_t cycle_stack_apply(trace_cycle_stack_t* stack, char phase, int64_t value)
+{
+	if (phase == 'B')
+	{
+		if (stack->depth < k_trace_max_depth)
+		{
+			stack->begins[stack->depth] = value;
+		}
+		stack->depth++;
+	}
+	else if (phase == 'E')
+	{
+		// An end with no begin started before a flight recorder dump's window.
+		if (stack->depth == 0)
+		{
+			return 0;
+		}
+		stack->depth--;
+		int64_t begin = stack->depth < k_trace_max_depth ? stack->begins[stack->depth] : 0;
+		return begin && value ? value - begin : 0;
+	}
+	return value;
+}
+
+static void thread_record(trace_t* trace, trace_thread_t* thread, uint32_t site, char phase, int64_t value)
+{
+	// Pairs with FlushProcessWriteBuffers in trace_capture_stop: either it sees
+	// the flag and waits, or this sees the mode is off. Only the compiler needs
+	// holding back here; stop pays for the processor fence.
+	atomic_store32(&thread->recording, 1, k_atomic_relaxed);
+	atomic_fence(k_atomic_acquire);
+	trace_mode_t mode = atomic_load32((const volatile int32_t*)&trace->mode, k_atomic_relaxed);
+	if (mode == k_trace_mode_off)
+	{
+		atomic_store32(&thread->recording, 0, k_atomic_release);
+		return;
+	}
+
+	int32_t generation = atomic_load32(&trace->generation, k_atomic_relaxed);
+	if (thread->generation != generation)
+	{
+		atomic_store32(&thread->count, 0, k_atomic_relaxed);
+		atomic_store32(&thread->dropped, 0, k_atomic_relaxed);
+		atomic_store32(&thread->read_count, 0, k_atomic_relaxed);
+		atomic_store32(&thread->generation, generation, k_atomic_release);
+	}
+
+	int32_t count = thread->count;
+	if (mode != k_trace_mode_flight_recorder || !thread->capacity)
+	{
+		// Slots are reused only once the capture writer has consumed them.
+		uint32_t read_count = (uint32_t)atomic_load32(&thread->read_count, k_atomic_acquire);
+		if ((uint32_t)count - read_count >= (uint32_t)thread->capacity)
+		{
+			thread->dropped++;
+			atomic_store32(&thread->recording, 0, k_atomic_release);
+			return;
+		}
+	}
+
+	trace_event_t* event = &thread->events[(uint32_t)count & (uint32_t)(thread->capacity - 1)];
+	event->site = site;
+	event->ticks = timer_get_fast_ticks();
+	event->phase = phase;
+	event->value = value;
+	atomic_store32(&thread->count, (int32_t)((uint32_t)count + 1), k_atomic_release);
+	atomic_store32(&thread->recording, 0, k_atomic_release);
 }
@@ -1,27 +1,154 @@
 #pragma once
 
 #include "heap.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Define TRACE_ENABLED to 0 to compile out the TRACE_ macros.
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+typedef struct contention_t contention_t;
+typedef struct fs_t fs_t;
 typedef struct heap_t heap_t;
 
 typedef struct trace_t trace_t;
 
+// A place in the code that records trace events, usually declared static by the TRACE_ macros.
+// Events refer to their site by a small id, so the name, file and line are stored once per capture.
+typedef struct trace_site_t
+{
+	const char* name;
+	const char* file;
+	int line;
+	// Assigned on first use; zero until then.
+	int32_t id;
+} trace_site_t;
+
 // Creates a CPU performance tracing system.
-// Event capacity is the maximum number of durations that can be traced.
+// Event capacity is the number of events each thread can buffer, rounded up to a power of two.
+// A capture streams buffers to disk as it runs; the flight recorder keeps the most recent capacity events.
+// Each thread's buffer is allocated on its first event; recording never allocates or locks.
 trace_t* trace_create(heap_t* heap, int event_capacity);
 
 // Destroys a CPU performance tracing system.
 void trace_destroy(trace_t* trace);
 
+// Write captures and flight recorder dumps through the game's file system, so
+// they queue behind its reads at background priority. Call before starting
+// either, and destroy the trace before fs. Otherwise the trace creates its own.
+void trace_set_fs(trace_t* trace, fs_t* fs);
+
+// Functions and macros that record events accept a NULL trace and do nothing,
+// so systems can be instrumented whether or not a trace is attached.
+
+// Record the CPU cycles each duration's thread actually ran, exported as a "cycles" arg.
+// Cycles stop while a thread is descheduled, so a duration with far fewer cycles than
+// its wall time implies was waiting. Off by default; costs a system call per event.
+// Instruction, cache miss and branch counters need a kernel driver or ETW on Windows,
+// so are not available here.
+void trace_set_cycle_counting(trace_t* trace, bool enabled);
+
 // Begin tracing a named duration on the current thread.
 // It is okay to nest multiple durations at once.
+// The name is not copied and must stay valid for the life of the trace, e.g. a string literal.
+// Prefer TRACE_PUSH for fixed names; this looks the name up on every call.
 void trace_duration_push(trace_t* trace, const char* name);
 
+// Begin tracing a duration at a call site on the current thread.
+// The site must stay valid for the life of the trace; see TRACE_PUSH and TRACE_SCOPE.
+void trace_site_push(trace_t* trace, trace_site_t* site);
+
 // End tracing the currently active duration on the current thread.
 void trace_duration_pop(trace_t* trace);
 
+// Record a counter's value, shown as a track graphing it over time, e.g. bytes in use or queue depth.
+// Counters are per process; the site's name identifies the track.
+void trace_site_counter(trace_t* trace, trace_site_t* site, int64_t value);
+
+// Record a point in time on the current thread, e.g. a frame boundary or a hitch.
+void trace_site_instant(trace_t* trace, trace_site_t* site);
+
+// Begin a flow: an arrow from the enclosing duration on this thread to wherever
+// trace_site_flow_end is called with the same id, usually on another thread.
+// The id must be unique among flows in progress, e.g. the address of the work item.
+void trace_site_flow_begin(trace_t* trace, trace_site_t* site, uint64_t id);
+
+// End a flow begun with trace_site_flow_begin, attaching it to the enclosing duration.
+// Both ends should use the same name.
+void trace_site_flow_end(trace_t* trace, trace_site_t* site, uint64_t id);
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#if TRACE_ENABLED
+// Begin tracing a duration named by a string literal, with the file and line it comes from.
+// The site is registered on first use, so afterwards this costs a timestamp and a few plain stores.
+#define TRACE_PUSH(trace, name) \
+	do { static trace_site_t s_trace_site = { name, __FILE__, __LINE__, 0 }; trace_site_push((trace), &s_trace_site); } while (0)
+
+// End the duration begun by the most recent TRACE_PUSH or trace_duration_push.
+#define TRACE_POP(trace) trace_duration_pop(trace)
+
+#define TRACE_COUNTER(trace, name, value) \
+	do { static trace_site_t s_trace_site = { name, __FILE__, __LINE__, 0 }; trace_site_counter((trace), &s_trace_site, (value)); } while (0)
+#define TRACE_INSTANT(trace, name) \
+	do { static trace_site_t s_trace_site = { name, __FILE__, __LINE__, 0 }; trace_site_instant((trace), &s_trace_site); } while (0)
+#define TRACE_FLOW_BEGIN(trace, name, id) \
+	do { static trace_site_t s_trace_site = { name, __FILE__, __LINE__, 0 }; trace_site_flow_begin((trace), &s_trace_site, (id)); } while (0)
+#define TRACE_FLOW_END(trace, name, id) \
+	do { static trace_site_t s_trace_site = { name, __FILE__, __LINE__, 0 }; trace_site_flow_end((trace), &s_trace_site, (id)); } while (0)
+
+// Trace the block that follows as a duration:
+//   TRACE_SCOPE(trace, "update") { ... }
+// Leaving the block with return, break or goto skips the end of the duration.
+// Expands to a declaration and a statement, so it cannot be the body of an unbraced if or loop.
+#define TRACE_SCOPE(trace, name) \
+	static trace_site_t TRACE_CONCAT(s_trace_site_, __LINE__) = { name, __FILE__, __LINE__, 0 }; \
+	for (int TRACE_CONCAT(trace_scope_, __LINE__) = (trace_site_push((trace), &TRACE_CONCAT(s_trace_site_, __LINE__)), 0); \
+		!TRACE_CONCAT(trace_scope_, __LINE__); \
+		TRACE_CONCAT(trace_scope_, __LINE__) = (trace_duration_pop(trace), 1))
+#else
+#define TRACE_PUSH(trace, name) ((void)0)
+#define TRACE_POP(trace) ((void)0)
+#define TRACE_COUNTER(trace, name, value) ((void)0)
+#define TRACE_INSTANT(trace, name) ((void)0)
+#define TRACE_FLOW_BEGIN(trace, name, id) ((void)0)
+#define TRACE_FLOW_END(trace, name, id) ((void)0)
+#define TRACE_SCOPE(trace, name)
+#endif
+
 // Start recording trace events.
-// A Chrome trace file will be written to path.
+// Events are streamed to a compact binary trace at path by a background writer,
+// so captures are limited by disk space rather than buffer size.
+// Use trace_convert_to_json to view the result.
 void trace_capture_start(trace_t* trace, const char* path);
 
-// Stop recording trace events.
+// Stop recording trace events, blocking until everything recorded is written.
 void trace_capture_stop(trace_t* trace);
+
+// Convert a binary trace written by a capture to a Chrome trace file.
+// Reads and writes incrementally, so traces larger than memory are fine.
+// Returns zero on success.
+int trace_convert_to_json(heap_t* heap, const char* binary_path, const char* json_path);
+
+// Start recording continuously, keeping only the most recent events.
+// Each thread's buffer becomes a ring that overwrites its oldest events,
+// so the trace leading up to a problem can be written after the fact.
+// Replaces any capture in progress.
+void trace_flight_recorder_start(trace_t* trace);
+
+// Stop continuous recording.
+void trace_flight_recorder_stop(trace_t* trace);
+
+// Write the events from the last few seconds to a Chrome trace file at path.
+// Recording continues during and after the dump.
+// Only copies the events on the calling thread; the file is formatted and
+// written in the background. Skipped if an earlier dump is still waiting.
+void trace_flight_recorder_dump(trace_t* trace, const char* path, uint32_t seconds);
+
+// Include contention statistics in the trace output.
+// Statistics are read when the capture stops, so must outlive it.
+void trace_add_contention(trace_t* trace, const contention_t* contention);